@@ -56,6 +56,12 @@ def assemble(args, run_params, out_file, log_file, config_path):
     cmdline.extend(["--min-ovlp", str(run_params["min_overlap"])])
     if run_params["min_read_length"] > 0:
         cmdline.extend(["--min-read", str(run_params["min_read_length"])])
+    if run_params.get("asm_coverage", 0) > 0:
+        cmdline.extend(["--asm-coverage", str(run_params["asm_coverage"])])
+    if args.max_kmer_mem:
+        cmdline.extend(["--max-kmer-mem", str(args.max_kmer_mem)])
+    if args.index_cache:
+        cmdline.extend(["--index-cache", args.index_cache])
 
     if args.extra_params:
         cmdline.extend(["--extra-params", args.extra_params])
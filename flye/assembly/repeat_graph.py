@@ -52,6 +52,8 @@ def analyse_repeats(args, run_params, input_assembly, out_folder,
     #if args.kmer_size:
     #    cmdline.extend(["--kmer", str(args.kmer_size)])
     cmdline.extend(["--min-ovlp", str(run_params["min_overlap"])])
+    if args.index_cache:
+        cmdline.extend(["--index-cache", args.index_cache])
 
     if args.extra_params:
         cmdline.extend(["--extra-params", args.extra_params])
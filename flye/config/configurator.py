@@ -90,14 +90,14 @@ def setup_params(args):
     if args.asm_coverage and args.asm_coverage < coverage:
         target_cov = args.asm_coverage
 
+    #reads are subsampled (with preference to longer reads)
+    #by the assemble module while loading
+    parameters["min_read_length"] = 0
+    parameters["asm_coverage"] = 0
     if target_cov:
-        logger.info("Using longest %dx reads for contig assembly", target_cov)
-        min_read = _get_downsample_threshold(read_lengths,
-                                             args.genome_size * target_cov)
-        logger.debug("Min read length cutoff: %d", min_read)
-        parameters["min_read_length"] = min_read
-    else:
-        parameters["min_read_length"] = 0
+        logger.info("Subsampling reads to %dx coverage for contig assembly",
+                    target_cov)
+        parameters["asm_coverage"] = target_cov
 
     return parameters
 
@@ -114,12 +114,3 @@ def _calc_nx(scaffolds_lengths, assembly_len, rate):
             break
     return l50, n50
 
-
-def _get_downsample_threshold(read_lengths, target_len):
-    sum_len = 0
-    for l in sorted(read_lengths, reverse=True):
-        sum_len += l
-        if sum_len > target_len:
-            return l
-
-    return 0
@@ -548,8 +548,9 @@ def _epilog():
             "types is not yet supported. The --meta option enables the mode\n"
             "for metagenome/uneven coverage assembly.\n\n"
             "To reduce memory consumption for large genome assemblies,\n"
-            "you can use a subset of the longest reads for initial disjointig\n"
-            "assembly by specifying --asm-coverage and --genome-size options. Typically,\n"
+            "you can use a random subset of reads (biased towards longer reads)\n"
+            "for initial disjointig assembly by specifying --asm-coverage and\n"
+            "--genome-size options. Typically,\n"
             "40x coverage is enough to produce good disjointigs.\n\n"
             "You can run Flye polisher as a standalone tool using\n"
             "--polish-target option.")
@@ -626,6 +627,12 @@ def main():
     parser.add_argument("--asm-coverage", dest="asm_coverage", metavar="int",
                         default=None, help="reduced coverage for initial "
                         "disjointig assembly [not set]", type=int)
+    parser.add_argument("--max-kmer-mem", dest="max_kmer_mem", metavar="float",
+                        default=None, help="memory budget for k-mer counting, "
+                        "in Gb [not set]", type=float)
+    parser.add_argument("--index-cache", dest="index_cache", metavar="path",
+                        default=None, help="directory to save and reuse "
+                        "k-mer indexes between runs [not set]")
     parser.add_argument("--hifi-error", dest="hifi_error", metavar="float",
                         default=None, help="[deprecated] same as --read-error", type=float)
     parser.add_argument("--read-error", dest="read_error", metavar="float",
@@ -737,6 +744,11 @@ def main():
 
     args.reads = [os.path.abspath(r) for r in args.reads]
 
+    if args.index_cache:
+        if not os.path.isdir(args.index_cache):
+            os.mkdir(args.index_cache)
+        args.index_cache = os.path.abspath(args.index_cache)
+
     args.log_file = os.path.join(args.out_dir, "flye.log")
     _enable_logging(args.log_file, args.debug,
                     overwrite=False)
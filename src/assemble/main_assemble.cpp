@@ -26,13 +26,16 @@ bool parseArgs(int argc, char** argv, std::string& readsFasta,
 			   std::string& outAssembly, std::string& logFile, size_t& genomeSize,
 			   int& kmerSize, bool& debug, size_t& numThreads, int& minOverlap, 
 			   std::string& configPath, int& minReadLength, bool& unevenCov, 
-			   std::string& extraParams, bool& shortMode)
+			   std::string& extraParams, bool& shortMode, int& asmCoverage,
+			   float& maxKmerMem, std::string& indexCacheDir)
 {
 	auto printUsage = []()
 	{
 		std::cerr << "Usage: flye-assemble "
 				  << " --reads path --out-asm path --config path [--genome-size size]\n"
-				  << "\t\t[--min-read length] [--log path] [--treads num] [--extra-params]\n"
+				  << "\t\t[--min-read length] [--asm-coverage cov] [--log path]\n"
+				  << "\t\t[--max-kmer-mem size] [--index-cache path]\n"
+				  << "\t\t[--treads num] [--extra-params]\n"
 				  << "\t\t[--kmer size] [--meta] [--short] [--min-ovlp size] [--debug] [-h]\n\n"
 				  << "Required arguments:\n"
 				  << "  --reads path\tcomma-separated list of read files\n"
@@ -41,6 +44,12 @@ bool parseArgs(int argc, char** argv, std::string& readsFasta,
 				  << "Optional arguments:\n"
 				  << "  --genome-size size\tgenome size in bytes\n"
 				  << "  --kmer size\tk-mer size [default = 15] \n"
+				  << "  --asm-coverage cov\tsubsample reads to the given coverage "
+				  << "(requires genome size) [default = not set] \n"
+				  << "  --max-kmer-mem size\tmemory budget for k-mer counting, in Gb. "
+				  << "Temporary files are used if needed [default = not set] \n"
+				  << "  --index-cache path\tdirectory to save and reuse the read index "
+				  << "between runs [default = not set] \n"
 				  << "  --min-ovlp size\tminimum overlap between reads "
 				  << "[default = 5000] \n"
 				  << "  --debug \t\tenable debug output "
@@ -65,6 +74,9 @@ bool parseArgs(int argc, char** argv, std::string& readsFasta,
 		{"genome-size", required_argument, 0, 0},
 		{"config", required_argument, 0, 0},
 		{"min-read", required_argument, 0, 0},
+		{"asm-coverage", required_argument, 0, 0},
+		{"max-kmer-mem", required_argument, 0, 0},
+		{"index-cache", required_argument, 0, 0},
 		{"log", required_argument, 0, 0},
 		{"threads", required_argument, 0, 0},
 		{"kmer", required_argument, 0, 0},
@@ -86,6 +98,12 @@ bool parseArgs(int argc, char** argv, std::string& readsFasta,
 				kmerSize = atoi(optarg);
 			else if (!strcmp(longOptions[optionIndex].name, "min-read"))
 				minReadLength = atoi(optarg);
+			else if (!strcmp(longOptions[optionIndex].name, "asm-coverage"))
+				asmCoverage = atoi(optarg);
+			else if (!strcmp(longOptions[optionIndex].name, "max-kmer-mem"))
+				maxKmerMem = atof(optarg);
+			else if (!strcmp(longOptions[optionIndex].name, "index-cache"))
+				indexCacheDir = optarg;
 			else if (!strcmp(longOptions[optionIndex].name, "threads"))
 				numThreads = atoi(optarg);
 			else if (!strcmp(longOptions[optionIndex].name, "min-ovlp"))
@@ -154,7 +172,7 @@ void removeContainedDisjointigs(std::vector<FastaRecord>& disjointigs,
 	Logger::get().info() << "Filtering contained disjointigs";
 	disjOverlaps.findAllOverlaps();
 	std::unordered_set<std::string> containedDisj;
-	for (auto& seq : disjSequences.iterSeqs())
+	for (const auto& seq : disjSequences.iterSeqs())
 	{
 		for (auto& ovlp : disjOverlaps.lazySeqOverlaps(seq.id))
 		{
@@ -193,6 +211,8 @@ int assemble_main(int argc, char** argv)
 
 	int kmerSize = -1;
 	int minReadLength = 0;
+	int asmCoverage = 0;
+	float maxKmerMem = 0;
 	size_t genomeSize = 0;
 	int minOverlap = 5000;
 	bool debugging = false;
@@ -204,10 +224,12 @@ int assemble_main(int argc, char** argv)
 	std::string logFile;
 	std::string configPath;
 	std::string extraParams;
+	std::string indexCacheDir;
 
 	if (!parseArgs(argc, argv, readsFasta, outAssembly, logFile, genomeSize,
 				   kmerSize, debugging, numThreads, minOverlap, configPath, 
-				   minReadLength, unevenCov, extraParams, shortMode)) return 1;
+				   minReadLength, unevenCov, extraParams, shortMode, 
+				   asmCoverage, maxKmerMem, indexCacheDir)) return 1;
 
 	Logger::get().setDebugging(debugging);
 	if (!logFile.empty()) Logger::get().setOutputFile(logFile);
@@ -231,6 +253,7 @@ int assemble_main(int argc, char** argv)
 	Parameters::get().minimumOverlap = minOverlap;
 	Parameters::get().unevenCoverage = unevenCov;
 	Parameters::get().shortSequences = shortMode;
+	Parameters::get().indexCacheDir = indexCacheDir;
 	Logger::get().debug() << "Running with k-mer size: " << 
 		Parameters::get().kmerSize; 
 	Logger::get().debug() << "Running with minimum overlap " << minOverlap;
@@ -246,12 +269,20 @@ int assemble_main(int argc, char** argv)
 	try
 	{
 		//only use reads that are longer than minOverlap,
-		//or a specified threshold (used for downsampling)
+		//or a specified threshold. If the target coverage is given,
+		//reads are also subsampled while loading
 		minReadLength = std::max(minReadLength, minOverlap);
-		for (auto& readsFile : readsList)
+		size_t maxTotalLength = 0;
+		if (asmCoverage > 0 && genomeSize > 0)
 		{
-			readsContainer.loadFromFile(readsFile, minReadLength);
+			maxTotalLength = genomeSize * asmCoverage;
+			Logger::get().debug() << "Subsampling reads to " << asmCoverage 
+				<< "x coverage";
 		}
+		readsContainer.setQualityTrimming((int)Config::get("read_trim_min_quality"),
+										  (int)Config::get("read_trim_window"),
+										  (bool)Config::get("read_trim_longest_segment"));
+		readsContainer.loadFromFiles(readsList, minReadLength, maxTotalLength);
 	}
 	catch (SequenceContainer::ParseException& e)
 	{
@@ -259,11 +290,28 @@ int assemble_main(int argc, char** argv)
 		return 1;
 	}
 	readsContainer.buildPositionIndex();
+	if ((bool)Config::get("reads_base_alignment") &&
+		(bool)Config::get("hpc_scoring_on"))
+	{
+		readsContainer.buildHpcIndex();
+	}
 	VertexIndex vertexIndex(readsContainer);
 	vertexIndex.outputProgress(true);
+	//temporary files go next to the output assembly. They are also
+	//used without the budget, if the reads do not fit into a few 
+	//in-memory counting passes
+	size_t dirEnd = outAssembly.rfind('/');
+	std::string tempDir = dirEnd != std::string::npos ? 
+						  outAssembly.substr(0, dirEnd) : ".";
+	vertexIndex.setKmerMemoryBudget(maxKmerMem * 1024 * 1024 * 1024, tempDir);
+	if (maxKmerMem > 0)
+	{
+		Logger::get().debug() << "K-mer counting memory budget: " 
+			<< maxKmerMem << " Gb";
+	}
 
 	/*int64_t sumLength = 0;
-	for (auto& seq : readsContainer.iterSeqs())
+	for (const auto& seq : readsContainer.iterSeqs())
 	{
 		sumLength += seq.sequence.length();
 	}
@@ -279,13 +327,23 @@ int assemble_main(int argc, char** argv)
 	if (useMinimizers)
 	{
 		const int minWnd = Config::get("minimizer_window");
-		vertexIndex.buildIndexMinimizers(/*min freq*/ 1, minWnd);
+		vertexIndex.buildCached("reads", "minimizers wnd=" + std::to_string(minWnd),
+								[&vertexIndex, minWnd]()
+		{
+			vertexIndex.buildIndexMinimizers(/*min freq*/ 1, minWnd);
+		});
 	}
 	else	//indexing using solid k-mers
 	{
-		vertexIndex.countKmers();
-		vertexIndex.buildIndexUnevenCoverage(MIN_FREQ, SELECT_RATE, 
-											 TANDEM_FREQ);
+		const std::string params = "solid min_freq=" + std::to_string(MIN_FREQ) +
+			" select_rate=" + std::to_string(SELECT_RATE) + 
+			" tandem_freq=" + std::to_string(TANDEM_FREQ);
+		vertexIndex.buildCached("reads", params, [&vertexIndex]()
+		{
+			vertexIndex.countKmers();
+			vertexIndex.buildIndexUnevenCoverage(MIN_FREQ, SELECT_RATE, 
+												 TANDEM_FREQ);
+		});
 	}
 
 	Logger::get().debug() << "Peak RAM usage: " 
@@ -0,0 +1,79 @@
+//(c) 2020 by Authors
+//This file is a part of Flye program.
+//Released under the BSD license (see LICENSE file)
+
+//Decoding of packed sequences into text: the table-based str()
+//against the per-nucleotide decoding through at(), for both strands
+//and for substring views.
+//Usage: bench_dna_decode [sequence length] [repeats]
+
+#include <chrono>
+#include <random>
+#include <cstdio>
+#include <cstdlib>
+
+#include "../sequence/sequence.h"
+
+namespace
+{
+	//the decoding used before the table: one nucleotide at a time
+	std::string decodeByBase(const DnaSequence& seq)
+	{
+		std::string result;
+		result.reserve(seq.length());
+		for (size_t i = 0; i < seq.length(); ++i)
+		{
+			result.push_back(seq.at(i));
+		}
+		return result;
+	}
+
+	template <class F>
+	double measure(F fun, size_t repeats, size_t& checksum)
+	{
+		auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < repeats; ++i)
+		{
+			std::string decoded = fun();
+			checksum += decoded[i % decoded.length()];
+		}
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+											 start).count();
+	}
+
+	void compare(const char* name, const DnaSequence& seq, size_t repeats)
+	{
+		if (decodeByBase(seq) != seq.str())
+		{
+			printf("%s: decoded sequences differ\n", name);
+			exit(1);
+		}
+		size_t checksum = 0;
+		const double byBase = measure([&seq](){return decodeByBase(seq);},
+									  repeats, checksum);
+		const double table = measure([&seq](){return seq.str();},
+									 repeats, checksum);
+		const double mbases = (double)seq.length() * repeats / 1e6;
+		printf("%-12s per-base %8.1f Mb/s   table %8.1f Mb/s   speedup %.1fx  (%zu)\n",
+			   name, mbases / byBase, mbases / table, byBase / table,
+			   checksum % 10);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const size_t length = argc > 1 ? atol(argv[1]) : 1000000;
+	const size_t repeats = argc > 2 ? atol(argv[2]) : 100;
+
+	std::mt19937 randGen(1);
+	std::string text(length, 'A');
+	for (auto& c : text) c = "ACGT"[randGen() % 4];
+	DnaSequence seq(text);
+
+	compare("forward", seq, repeats);
+	compare("complement", seq.complement(), repeats);
+	compare("substr", seq.substr(length / 3, length / 2), repeats);
+	compare("substr-rc", seq.complement().substr(length / 3, length / 2),
+			repeats);
+	return 0;
+}
@@ -0,0 +1,180 @@
+//(c) 2020 by Authors
+//This file is a part of Flye program.
+//Released under the BSD license (see LICENSE file)
+
+//Index lookups, as done by the overlap detector: single queries
+//through iterKmerPos against batched queries through iterKmerPosBatch.
+//The queries are the k-mers of the indexed reads in random order,
+//and every 10th is a random (mostly absent) k-mer. Where hardware
+//performance counters are available (perf_event_open), cycles,
+//instructions and cache misses per query are reported as well.
+//Usage: bench_index_query [number of reads] [read length]
+
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "../sequence/vertex_index.h"
+
+namespace
+{
+	class PerfCounters
+	{
+	public:
+		PerfCounters()
+		{
+			const uint64_t events[NUM_EVENTS] = {PERF_COUNT_HW_CPU_CYCLES,
+												 PERF_COUNT_HW_INSTRUCTIONS,
+												 PERF_COUNT_HW_CACHE_MISSES};
+			for (size_t i = 0; i < NUM_EVENTS; ++i)
+			{
+				perf_event_attr attr;
+				memset(&attr, 0, sizeof(attr));
+				attr.type = PERF_TYPE_HARDWARE;
+				attr.size = sizeof(attr);
+				attr.config = events[i];
+				attr.disabled = 1;
+				attr.exclude_kernel = 1;
+				attr.exclude_hv = 1;
+				_fds[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+			}
+		}
+
+		~PerfCounters()
+		{
+			for (int fd : _fds) if (fd >= 0) close(fd);
+		}
+
+		void start()
+		{
+			for (int fd : _fds)
+			{
+				if (fd < 0) continue;
+				ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+				ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+			}
+		}
+
+		void stopAndPrint(size_t numQueries)
+		{
+			const char* names[NUM_EVENTS] = {"cycles", "instructions",
+											 "cache-misses"};
+			for (size_t i = 0; i < NUM_EVENTS; ++i)
+			{
+				long long value = 0;
+				if (_fds[i] < 0 ||
+					ioctl(_fds[i], PERF_EVENT_IOC_DISABLE, 0) != 0 ||
+					read(_fds[i], &value, sizeof(value)) != sizeof(value))
+				{
+					printf("  %s n/a", names[i]);
+					continue;
+				}
+				printf("  %s/q %.1f", names[i], (double)value / numQueries);
+			}
+			printf("\n");
+		}
+
+	private:
+		static const size_t NUM_EVENTS = 3;
+		int _fds[NUM_EVENTS];
+	};
+}
+
+int main(int argc, char** argv)
+{
+	const size_t numReads = argc > 1 ? atol(argv[1]) : 4000;
+	const size_t readLength = argc > 2 ? atol(argv[2]) : 10000;
+	const size_t kmerSize = 17;
+	Parameters::get().kmerSize = kmerSize;
+	Parameters::get().numThreads = 1;
+	Config::addParameters("kmer_sampling=0,repeat_kmer_rate=10");
+
+	std::mt19937_64 randGen(1);
+	SequenceContainer seqContainer;
+	for (size_t i = 0; i < numReads; ++i)
+	{
+		std::string text(readLength, 'A');
+		for (auto& c : text) c = "ACGT"[randGen() % 4];
+		seqContainer.addSequence(DnaSequence(text), "read" + std::to_string(i));
+	}
+	seqContainer.buildPositionIndex();
+	VertexIndex vertexIndex(seqContainer);
+	vertexIndex.buildIndexMinimizers(/*min coverage*/ 1, /*window*/ 1);
+
+	std::vector<CanonicalKmerPosition> queries;
+	for (const auto& seq : seqContainer.iterSeqs())
+	{
+		if (!seq.id.strand()) continue;
+		for (const auto& kmerPos : IterCanonicalKmers(seq.sequence))
+		{
+			queries.push_back(kmerPos);
+		}
+	}
+	std::shuffle(queries.begin(), queries.end(), randGen);
+	for (size_t i = 0; i < queries.size(); i += 10)
+	{
+		Kmer kmer(0);
+		for (size_t j = 0; j < kmerSize; ++j) kmer.appendRight(randGen() % 4);
+		const bool revComp = kmer.standardForm();
+		queries[i] = CanonicalKmerPosition(kmer, 0, revComp);
+	}
+	printf("%zu reads x %zu bp, %zu queries\n", numReads, readLength,
+		   queries.size());
+
+	PerfCounters counters;
+	size_t checkSingle = 0;
+	counters.start();
+	auto start = std::chrono::steady_clock::now();
+	for (const auto& query : queries)
+	{
+		bool repetitive = false;
+		for (const auto& pos : vertexIndex.iterKmerPos(query, repetitive))
+		{
+			checkSingle += pos.position + repetitive;
+		}
+	}
+	const double timeSingle = std::chrono::duration<double>
+		(std::chrono::steady_clock::now() - start).count();
+	printf("single: %6.1f ns/query", timeSingle / queries.size() * 1e9);
+	counters.stopAndPrint(queries.size());
+
+	size_t checkBatch = 0;
+	std::vector<VertexIndex::IterHelper> positions;
+	bool repetitive[VertexIndex::QUERY_BATCH];
+	counters.start();
+	start = std::chrono::steady_clock::now();
+	for (size_t batch = 0; batch < queries.size();
+		 batch += VertexIndex::QUERY_BATCH)
+	{
+		const size_t batchSize = std::min(VertexIndex::QUERY_BATCH,
+										  queries.size() - batch);
+		vertexIndex.iterKmerPosBatch(&queries[batch], batchSize,
+									 positions, repetitive);
+		for (size_t i = 0; i < batchSize; ++i)
+		{
+			for (const auto& pos : positions[i])
+			{
+				checkBatch += pos.position + repetitive[i];
+			}
+		}
+	}
+	const double timeBatch = std::chrono::duration<double>
+		(std::chrono::steady_clock::now() - start).count();
+	printf("batch:  %6.1f ns/query", timeBatch / queries.size() * 1e9);
+	counters.stopAndPrint(queries.size());
+
+	if (checkSingle != checkBatch)
+	{
+		printf("Query results differ\n");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,142 @@
+//(c) 2020 by Authors
+//This file is a part of Flye program.
+//Released under the BSD license (see LICENSE file)
+
+//Minimizer selection: yieldMinimizers against the previous
+//implementation, which kept the window in a std::deque and
+//returned a new vector for every sequence. Both strands of random
+//reads are processed; the selected minimizers must be identical.
+//Usage: bench_minimizers [number of reads] [read length] [kmer size]
+
+#include <chrono>
+#include <random>
+#include <deque>
+#include <cstdio>
+#include <cstdlib>
+
+#include "../sequence/kmer.h"
+
+namespace
+{
+	//the implementation used before the ring buffer
+	std::vector<CanonicalKmerPosition>
+		yieldMinimizersDeque(const DnaSequence& sequence, int window)
+	{
+		struct KmerAndHash
+		{
+			CanonicalKmerPosition kp;
+			size_t hash;
+		};
+		thread_local std::deque<KmerAndHash> miniQueue;
+		miniQueue.clear();
+
+		std::vector<CanonicalKmerPosition> minimizers;
+		const size_t expectedSize = sequence.length() / window * 2;
+		minimizers.reserve(1.5 * expectedSize);
+
+		if (window == 1)
+		{
+			for (auto kmerPos : IterCanonicalKmers(sequence))
+			{
+				minimizers.push_back(kmerPos);
+			}
+			return minimizers;
+		}
+
+		for (auto kmerPos : IterCanonicalKmers(sequence))
+		{
+			size_t curHash = kmerPos.kmer.hash();
+			while (!miniQueue.empty() && miniQueue.back().hash > curHash)
+			{
+				miniQueue.pop_back();
+			}
+			miniQueue.push_back({kmerPos, curHash});
+			if (miniQueue.front().kp.position <= kmerPos.position - window)
+			{
+				while (miniQueue.front().kp.position <= kmerPos.position - window)
+				{
+					miniQueue.pop_front();
+				}
+				while (miniQueue.size() >= 2 && miniQueue[0].hash == miniQueue[1].hash)
+				{
+					miniQueue.pop_front();
+				}
+			}
+			if (minimizers.empty() || minimizers.back().position !=
+									  miniQueue.front().kp.position)
+			{
+				minimizers.push_back(miniQueue.front().kp);
+			}
+		}
+		return minimizers;
+	}
+
+	bool sameMinimizers(const std::vector<CanonicalKmerPosition>& first,
+						const std::vector<CanonicalKmerPosition>& second)
+	{
+		if (first.size() != second.size()) return false;
+		for (size_t i = 0; i < first.size(); ++i)
+		{
+			if (first[i].kmer != second[i].kmer ||
+				first[i].position != second[i].position ||
+				first[i].revComp != second[i].revComp) return false;
+		}
+		return true;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const size_t numReads = argc > 1 ? atol(argv[1]) : 2500;
+	const size_t readLength = argc > 2 ? atol(argv[2]) : 20000;
+	Parameters::get().kmerSize = argc > 3 ? atol(argv[3]) : 15;
+
+	std::mt19937 randGen(1);
+	std::vector<DnaSequence> reads;
+	size_t totalLength = 0;
+	for (size_t i = 0; i < numReads; ++i)
+	{
+		std::string text(readLength + i % 97, 'A');
+		for (auto& c : text) c = "ACGT"[randGen() % 4];
+		reads.emplace_back(text);
+		if (i % 2) reads.back() = reads.back().complement();
+		totalLength += reads.back().length();
+	}
+
+	for (int window : {1, 5, 10})
+	{
+		std::vector<CanonicalKmerPosition> minimizers;
+		for (const auto& read : reads)
+		{
+			yieldMinimizers(read, window, minimizers);
+			if (!sameMinimizers(yieldMinimizersDeque(read, window), minimizers))
+			{
+				printf("w=%d: selected minimizers differ\n", window);
+				return 1;
+			}
+		}
+
+		size_t checksum = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (const auto& read : reads)
+		{
+			checksum += yieldMinimizersDeque(read, window).size();
+		}
+		const double timeDeque = std::chrono::duration<double>
+			(std::chrono::steady_clock::now() - start).count();
+
+		start = std::chrono::steady_clock::now();
+		for (const auto& read : reads)
+		{
+			yieldMinimizers(read, window, minimizers);
+			checksum += minimizers.size();
+		}
+		const double timeRing = std::chrono::duration<double>
+			(std::chrono::steady_clock::now() - start).count();
+
+		printf("w=%-3d deque %6.3f Gb/s   ring buffer %6.3f Gb/s   speedup %.2fx  (%zu)\n",
+			   window, totalLength / timeDeque / 1e9, totalLength / timeRing / 1e9,
+			   timeDeque / timeRing, checksum % 10);
+	}
+	return 0;
+}
@@ -0,0 +1,149 @@
+//(c) 2020 by Authors
+//This file is a part of Flye program.
+//Released under the BSD license (see LICENSE file)
+
+//Decoding of global positions into (sequence, position) pairs, as
+//done for every k-mer hit. SequenceContainer::seqPosition is compared
+//against the previous layout: (offset, length) pairs with a hint
+//for every 1000 positions. The memory of both layouts is reported.
+//A percentage of the sequences could be made short (1/50 of the mean
+//length), so that some of the hint blocks hold many sequence starts.
+//Usage: bench_seq_position [number of sequences] [mean length] [queries]
+//						   [short sequences, %]
+
+#include <chrono>
+#include <random>
+#include <limits>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+#include "../sequence/sequence_container.h"
+
+namespace
+{
+	class PairsIndex
+	{
+	public:
+		explicit PairsIndex(const SequenceContainer& seqContainer)
+		{
+			size_t offset = 0;
+			for (const auto& seq : seqContainer.iterSeqs())
+			{
+				_offsets.push_back({offset, seq.sequence.length()});
+				_ids.push_back(seq.id);
+				offset += seq.sequence.length();
+			}
+			_offsets.push_back({offset, 0});
+			size_t idx = 0;
+			for (size_t i = 0; i <= (offset - 1) / CHUNK; ++i)
+			{
+				while (i * CHUNK >= _offsets[idx + 1].offset) ++idx;
+				_hint.push_back(idx);
+			}
+		}
+
+		void seqPosition(size_t globPos, FastaRecord::Id& outSeqId,
+						 int32_t& outPosition, int32_t& outLen) const
+		{
+			size_t hint = _hint[globPos / CHUNK];
+			while (_offsets[hint + 1].offset <= globPos) ++hint;
+			outSeqId = _ids[hint];
+			outPosition = globPos - _offsets[hint].offset;
+			outLen = _offsets[hint].length;
+		}
+
+		size_t memoryUsage() const
+		{
+			return _offsets.size() * sizeof(OffsetPair) +
+				   _hint.size() * sizeof(size_t);
+		}
+
+		size_t totalLength() const {return _offsets.back().offset;}
+
+	private:
+		static const size_t CHUNK = 1000;
+		struct OffsetPair
+		{
+			size_t offset;
+			size_t length;
+		};
+		std::vector<OffsetPair> _offsets;
+		std::vector<size_t> _hint;
+		std::vector<FastaRecord::Id> _ids;
+	};
+}
+
+int main(int argc, char** argv)
+{
+	const size_t numSeqs = argc > 1 ? atol(argv[1]) : 200000;
+	const size_t meanLength = argc > 2 ? atol(argv[2]) : 300;
+	const size_t numQueries = argc > 3 ? atol(argv[3]) : 20000000;
+	const size_t shortPercent = argc > 4 ? atol(argv[4]) : 0;
+
+	std::mt19937_64 randGen(1);
+	SequenceContainer seqContainer;
+	for (size_t i = 0; i < numSeqs; ++i)
+	{
+		const size_t length = randGen() % 100 < shortPercent ? 
+			meanLength / 50 + 1 : meanLength / 2 + randGen() % meanLength;
+		std::string text(length, 'A');
+		for (auto& c : text) c = "ACGT"[randGen() % 4];
+		seqContainer.addSequence(DnaSequence(text), "seq" + std::to_string(i));
+	}
+	seqContainer.buildPositionIndex();
+	PairsIndex pairsIndex(seqContainer);
+
+	std::vector<size_t> queries(numQueries);
+	for (auto& pos : queries) pos = randGen() % pairsIndex.totalLength();
+
+	//both layouts are timed in turns, and the best of the rounds is
+	//reported, so that neither gets a cold or a warm start
+	const int NUM_ROUNDS = 3;
+	double timePairs = std::numeric_limits<double>::max();
+	double timeContainer = std::numeric_limits<double>::max();
+	size_t checkPairs = 0;
+	size_t checkContainer = 0;
+	for (int round = 0; round < NUM_ROUNDS; ++round)
+	{
+		checkPairs = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (size_t pos : queries)
+		{
+			FastaRecord::Id seqId;
+			int32_t position = 0;
+			int32_t length = 0;
+			pairsIndex.seqPosition(pos, seqId, position, length);
+			checkPairs += seqId.signedId() + position + length;
+		}
+		timePairs = std::min(timePairs, std::chrono::duration<double>
+			(std::chrono::steady_clock::now() - start).count());
+
+		checkContainer = 0;
+		start = std::chrono::steady_clock::now();
+		for (size_t pos : queries)
+		{
+			FastaRecord::Id seqId;
+			int32_t position = 0;
+			int32_t length = 0;
+			seqContainer.seqPosition(pos, seqId, position, length);
+			checkContainer += seqId.signedId() + position + length;
+		}
+		timeContainer = std::min(timeContainer, std::chrono::duration<double>
+			(std::chrono::steady_clock::now() - start).count());
+	}
+
+	printf("%zu sequences x %zu bp (%zu%% short), %zu queries\n", numSeqs, 
+		   meanLength, shortPercent, numQueries);
+	printf("pairs + hints:  %6.1f Mhits/s  (%.1f MB)\n",
+		   numQueries / timePairs / 1e6, pairsIndex.memoryUsage() / 1e6);
+	printf("seqPosition:    %6.1f Mhits/s  (%.1f MB)\n", 
+		   numQueries / timeContainer / 1e6, 
+		   seqContainer.positionIndexSize() / 1e6);
+	if (checkPairs != checkContainer)
+	{
+		printf("Decoded positions differ\n");
+		return 1;
+	}
+	return 0;
+}
@@ -113,4 +113,6 @@ struct Parameters
 	size_t 	numThreads;
 	bool 	unevenCoverage;
 	bool    shortSequences;
+	//directory where k-mer indexes are saved between runs (if set)
+	std::string indexCacheDir;
 };
@@ -175,7 +175,7 @@ void ContigExtender::generateContigs()
 			int32_t readStart = upathAln.front().aln.front().overlap.curBegin;
 			int32_t readEnd = upathAln.back().aln.back().overlap.curEnd;
 			extendedSeq = _readSeqs.getSeq(readId)
-				.substr(readStart, readEnd - readStart).str();
+				.str(readStart, readEnd - readStart);
 		}
 		if (lastIncomplete && graphContinue)
 		{
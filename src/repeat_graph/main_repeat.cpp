@@ -28,14 +28,15 @@ bool parseArgs(int argc, char** argv, std::string& readsFasta,
 			   std::string& inAssembly, int& kmerSize,
 			   int& minOverlap, bool& debug, size_t& numThreads, 
 			   std::string& configPath, bool& unevenCov,
-			   bool& keepHaplotypes, std::string& extraParams)
+			   bool& keepHaplotypes, std::string& extraParams,
+			   std::string& indexCacheDir)
 {
 	auto printUsage = []()
 	{
 		std::cerr << "Usage: flye-repeat "
 				  << " --disjointigs path --reads path --out-dir path --config path\n"
 				  << "\t\t[--log path] [--treads num] [--kmer size] [--meta] [--keep-haplotypes]\n"
-				  << "\t\t[--min-ovlp size] [--extra-params] [--debug] [-h]\n\n"
+				  << "\t\t[--min-ovlp size] [--extra-params] [--index-cache path] [--debug] [-h]\n\n"
 				  << "Required arguments:\n"
 				  << "  --disjointigs path\tpath to disjointigs file\n"
 				  << "  --reads path\tcomma-separated list of read files\n"
@@ -55,6 +56,8 @@ bool parseArgs(int argc, char** argv, std::string& readsFasta,
 				  << "[default = not set] \n"
 				  << "  --extra-params additional config parameters "
 				  << "[default = not set] \n"
+				  << "  --index-cache path\tdirectory to save and reuse k-mer indexes "
+				  << "between runs [default = not set] \n"
 				  << "  --threads num_threads\tnumber of parallel threads "
 				  << "[default = 1] \n";
 	};
@@ -71,6 +74,7 @@ bool parseArgs(int argc, char** argv, std::string& readsFasta,
 		{"kmer", required_argument, 0, 0},
 		{"min-ovlp", required_argument, 0, 0},
 		{"extra-params", required_argument, 0, 0},
+		{"index-cache", required_argument, 0, 0},
 		{"meta", no_argument, 0, 0},
 		{"keep-haplotypes", no_argument, 0, 0},
 		{"debug", no_argument, 0, 0},
@@ -107,6 +111,8 @@ bool parseArgs(int argc, char** argv, std::string& readsFasta,
 				configPath = optarg;
 			else if (!strcmp(longOptions[optionIndex].name, "extra-params"))
 				extraParams = optarg;
+			else if (!strcmp(longOptions[optionIndex].name, "index-cache"))
+				indexCacheDir = optarg;
 			break;
 
 		case 'h':
@@ -143,9 +149,11 @@ int repeat_main(int argc, char** argv)
 	std::string logFile;
 	std::string configPath;
 	std::string extraParams;
+	std::string indexCacheDir;
 	if (!parseArgs(argc, argv, readsFasta, outFolder, logFile, inAssembly,
 				   kmerSize, minOverlap, debugging, 
-				   numThreads, configPath, isMeta, keepHaplotypes, extraParams))  return 1;
+				   numThreads, configPath, isMeta, keepHaplotypes, extraParams,
+				   indexCacheDir))  return 1;
 	
 	Logger::get().setDebugging(debugging);
 	if (!logFile.empty()) Logger::get().setOutputFile(logFile);
@@ -168,6 +176,7 @@ int repeat_main(int argc, char** argv)
 	Parameters::get().kmerSize = kmerSize;
 	Parameters::get().minimumOverlap = minOverlap;
 	Parameters::get().unevenCoverage = isMeta;
+	Parameters::get().indexCacheDir = indexCacheDir;
 	Logger::get().debug() << "Running with k-mer size: " << 
 		Parameters::get().kmerSize; 
 	Logger::get().debug() << "Selected minimum overlap " << minOverlap;
@@ -186,6 +195,7 @@ int repeat_main(int argc, char** argv)
 		return 1;
 	}
 	seqAssembly.buildPositionIndex();
+	if ((bool)Config::get("hpc_scoring_on")) seqAssembly.buildHpcIndex();
 
 	Logger::get().info() << "Building repeat graph";
 	SequenceContainer edgeSequences;
@@ -205,6 +215,7 @@ int repeat_main(int argc, char** argv)
 		return 1;
 	}
 	seqReads.buildPositionIndex();
+	if ((bool)Config::get("hpc_scoring_on")) seqReads.buildHpcIndex();
 	//NOTE: it is important that we call the update below AFTER all reads
 	//are loaded. It ensures that all sequences for the repeat
 	//graph are stored in a continious chunk of memory.
@@ -303,7 +314,12 @@ int repeat_main(int argc, char** argv)
 	outGen.outputDot(proc.getEdgesPaths(), outFolder + "/graph_after_rr.gv");
 	rg.storeGraph(outFolder + "/repeat_graph_dump");
 	aligner.storeAlignments(outFolder + "/read_alignment_dump");
-	SequenceContainer::writeFasta(edgeSequences.iterSeqs(), 
+	std::vector<FastaRecord> edgeRecords;
+	for (const auto& seq : edgeSequences.iterSeqs())
+	{
+		if (seq.id.strand()) edgeRecords.push_back(edgeSequences.getRecord(seq.id));
+	}
+	SequenceContainer::writeFasta(edgeRecords, 
 								  outFolder + "/repeat_graph_edges.fasta",
 								  /*only pos strand*/ true);
 
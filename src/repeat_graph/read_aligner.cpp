@@ -8,6 +8,7 @@
 #include <cmath>
 #include <iomanip>
 #include <queue>
+#include <deque>
 
 namespace
 {
@@ -178,7 +179,11 @@ void ReadAligner::alignReads()
 	VertexIndex pathsIndex(_graph.edgeSequences());
 	bool useMinimizers = Config::get("use_minimizers");
 	int minWnd = useMinimizers ? Config::get("minimizer_window") : 1;
-	pathsIndex.buildIndexMinimizers(/*min freq*/ 1, minWnd);
+	pathsIndex.buildCached("graph_edges", "minimizers wnd=" + std::to_string(minWnd),
+						   [&pathsIndex, minWnd]()
+	{
+		pathsIndex.buildIndexMinimizers(/*min freq*/ 1, minWnd);
+	});
 
 	//pathsIndex.countKmers(/*min freq*/ 1, /* genome size*/ 0);
 	//pathsIndex.buildIndex(/*min freq*/ 1);
@@ -193,7 +198,7 @@ void ReadAligner::alignReads()
 
 	std::vector<FastaRecord::Id> allQueries;
 	int64_t totalLength = 0;
-	for (auto& read : _readSeqs.iterSeqs())
+	for (const auto& read : _readSeqs.iterSeqs())
 	{
 		if (!read.id.strand()) continue;
 		if (read.sequence.length() > (size_t)Parameters::get().minimumOverlap)
@@ -455,8 +460,8 @@ float ReadAligner::getChainBaseDivergence(const GraphAlignment& chain, bool real
 		if (realign)
 		{
 			ovlpDivergence = 
-				getAlignmentErrEdlib(aln.overlap, _readSeqs.getSeq(aln.overlap.curId), 
-									 _graph.edgeSequences().getSeq(aln.overlap.extId),
+				getAlignmentErrEdlib(aln.overlap, _readSeqs, 
+									 _graph.edgeSequences(),
 									 MAX_DIVERGENCE, USE_HPC);
 		}
 
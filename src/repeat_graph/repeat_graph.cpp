@@ -82,7 +82,11 @@ void RepeatGraph::build(bool keepHaplotypes)
 
 	bool useMinimizers = Config::get("use_minimizers");
 	int minWnd = useMinimizers ? Config::get("minimizer_window") : 1;
-	asmIndex.buildIndexMinimizers(/*min freq*/ 1, minWnd);
+	asmIndex.buildCached("disjointigs", "minimizers wnd=" + std::to_string(minWnd),
+						 [&asmIndex, minWnd]()
+	{
+		asmIndex.buildIndexMinimizers(/*min freq*/ 1, minWnd);
+	});
 
 	//asmIndex.countKmers(/*min freq*/ 1, /*genome size*/ 0);
 	//asmIndex.buildIndex(/*min freq*/ 1);
@@ -134,7 +138,7 @@ void RepeatGraph::getGluepoints(OverlapContainer& asmOverlaps)
 
 	//first, extract endpoints from all overlaps.
 	//each point has X and Y coordinates (curSeq and extSeq)
-	for (auto& seq : _asmSeqs.iterSeqs())
+	for (const auto& seq : _asmSeqs.iterSeqs())
 	{
 		for (auto& ovlp : asmOverlaps.lazySeqOverlaps(seq.id))
 		{
@@ -382,7 +386,7 @@ void RepeatGraph::getGluepoints(OverlapContainer& asmOverlaps)
 	}
 
 	//ensure that coordinates on forward and reverse contig copies are symmetric
-	for (auto& seq : _asmSeqs.iterSeqs())
+	for (const auto& seq : _asmSeqs.iterSeqs())
 	{
 		if (!seq.id.strand()) continue;
 
@@ -404,7 +408,7 @@ void RepeatGraph::getGluepoints(OverlapContainer& asmOverlaps)
 
 	//add contig end points, if needed
 	const int MAX_TIP = Parameters::get().minimumOverlap;
-	for (auto& seq : _asmSeqs.iterSeqs())
+	for (const auto& seq : _asmSeqs.iterSeqs())
 	{
 		if (!seq.id.strand()) continue;
 
@@ -459,7 +463,7 @@ void RepeatGraph::checkGluepointProjections(const OverlapContainer& asmOverlaps)
 		};
 
 		//for (auto& gp : _gluePoints)
-		for (auto& seq : _asmSeqs.iterSeqs())
+		for (const auto& seq : _asmSeqs.iterSeqs())
 		{
 			if (!seq.id.strand()) continue;
 			if (!_gluePoints.count(seq.id)) continue;
@@ -554,7 +558,7 @@ void RepeatGraph::checkGluepointProjections(const OverlapContainer& asmOverlaps)
 			<< " gluepoint projections";
 
 		//for (auto& gp : _gluePoints)
-		for (auto& seq : _asmSeqs.iterSeqs())
+		for (const auto& seq : _asmSeqs.iterSeqs())
 		{
 			if (!_gluePoints.count(seq.id)) continue;
 			for (auto& point : _gluePoints[seq.id])
@@ -724,7 +728,7 @@ void RepeatGraph::initializeEdges(const OverlapContainer& asmOverlaps)
 
 	//for (auto& seqEdgesPair : _gluePoints)
 	size_t checksum = 0;
-	for (auto& seq : _asmSeqs.iterSeqs())
+	for (const auto& seq : _asmSeqs.iterSeqs())
 	{
 		if (!seq.id.strand()) continue;
 		if (!_gluePoints.count(seq.id)) continue;
@@ -1025,7 +1029,7 @@ void RepeatGraph::logEdges()
 	}
 
 	//for (auto& seqEdgesPair : sequenceEdges)
-	for (auto& seq : _asmSeqs.iterSeqs())
+	for (const auto& seq : _asmSeqs.iterSeqs())
 	{
 		if (!seq.id.strand()) continue;
 		if (!sequenceEdges.count(seq.id)) continue;
@@ -1306,7 +1310,7 @@ EdgeSequence RepeatGraph::addEdgeSequence(const DnaSequence& sequence,
 							 			  const std::string& description)
 {
 	auto subSeq = sequence.substr(start, length);
-	auto& newRec = _edgeSeqsContainer->addSequence(subSeq, description);
+	auto newRec = _edgeSeqsContainer->addSequence(subSeq, description);
 	return EdgeSequence(newRec.id, newRec.sequence.length());
 }
 
@@ -1336,7 +1340,7 @@ void RepeatGraph::updateEdgeSequences()
 				_asmSeqs.getRecord(edgeSeq.origSeqId).description + "_" +
 				std::to_string(edgeSeq.origSeqStart) + "_" + 
 				std::to_string(edgeSeq.origSeqEnd);
-			auto& newRec = _edgeSeqsContainer->addSequence(subSeq, description);
+			auto newRec = _edgeSeqsContainer->addSequence(subSeq, description);
 
 			EdgeSequence newSeq = edgeSeq;
 			newSeq.edgeSeqId = newRec.id;
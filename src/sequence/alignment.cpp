@@ -45,28 +45,43 @@ namespace
 
 	struct CompressedSeq
 	{
-		DnaSequence seq;
+		std::string seq;
 		std::vector<int32_t> offsetTable;
 	};
 
-	CompressedSeq homopolymerCompression(const DnaSequence& seq, int32_t start, int32_t length,
-										 bool doCompression)
+	void homopolymerCompression(const DnaSequence& seq, int32_t start, int32_t length,
+								bool doCompression, CompressedSeq& out)
 	{
-		std::string newSeq;
-		newSeq.reserve(length);
-		std::vector<int32_t> offsetTable;
-		offsetTable.reserve(length);
+		out.seq.clear();
+		out.offsetTable.clear();
+		if (length <= 0) return;
 
-		for (size_t i = 0; i < (size_t)length; ++i)
+		const std::string region = seq.str(start, length);
+		for (size_t i = 0; i < region.size(); ++i)
 		{
-			if (!doCompression || i == 0 || newSeq.back() != seq.at(i + start))
+			if (!doCompression || i == 0 || out.seq.back() != region[i])
 			{
-				newSeq += seq.at(i + start);
-				offsetTable.push_back(i);
+				out.seq += region[i];
+				out.offsetTable.push_back(i);
 			}
 			
 		}
-		return {DnaSequence(newSeq), offsetTable};
+	}
+
+	//uses the precomputed HPC index of the container, if available
+	void compressRegion(const SequenceContainer& container, FastaRecord::Id seqId,
+						int32_t start, int32_t length, bool doCompression,
+						CompressedSeq& out)
+	{
+		if (doCompression && container.hasHpcIndex() && length > 0)
+		{
+			container.hpcRegion(seqId, start, length, out.seq, out.offsetTable);
+		}
+		else
+		{
+			homopolymerCompression(container.getSeq(seqId), start, length, 
+								   doCompression, out);
+		}
 	}
 
 	/*void printAlignment(const std::string& alnQry, const std::string& alnTrg)
@@ -97,159 +112,184 @@ namespace
 		}
 		Logger::get().debug() << "\n" << ss.str();
 	}*/
-}
-
-float getAlignmentCigarKsw(const DnaSequence& trgSeq, size_t trgBegin, size_t trgLen,
-			   			   const DnaSequence& qrySeq, size_t qryBegin, size_t qryLen,
-			   			   float maxAlnErr, std::vector<CigOp>& cigarOut)
-{
-	int matchScore = 2;
-	int misScore = -4;
-	int gapOpen = 4;
-	int gapExtend = 2;
-
-	thread_local ThreadMemPool buf;
-	thread_local std::vector<uint8_t> trgByte;
-	thread_local std::vector<uint8_t> qryByte;
-	buf.cleanIter();
-	trgByte.assign(trgLen, 0);
-	qryByte.assign(qryLen, 0);
 
-	for (size_t i = 0; i < trgLen; ++i)
-	{
-		trgByte[i] = trgSeq.atRaw(i + trgBegin);
-	}
-	for (size_t i = 0; i < qryLen; ++i)
+	//aligns the nucleotide codes (as in DnaSequence::atRaw) with ksw
+	//and outputs the cigar with the matches and mismatches separated
+	float getCodesCigarKsw(const std::vector<uint8_t>& trgByte, 
+						   const std::vector<uint8_t>& qryByte,
+						   float maxAlnErr, std::vector<CigOp>& cigarOut)
 	{
-		qryByte[i] = qrySeq.atRaw(i + qryBegin);
-	}
-
-	//substitution matrix
-	int8_t a = matchScore;
-	int8_t b = misScore < 0 ? misScore : -misScore; // a > 0 and b < 0
-	int8_t subsMat[] = {a, b, b, b, 0, 
-						b, a, b, b, 0, 
-						b, b, a, b, 0, 
-						b, b, b, a, 0, 
-						0, 0, 0, 0, 0};
-
-	const int NUM_NUCL = 5;
-	const int Z_DROP = -1;
-	const int FLAG = KSW_EZ_APPROX_MAX | KSW_EZ_APPROX_DROP;
-	const int END_BONUS = 0;
+		int matchScore = 2;
+		int misScore = -4;
+		int gapOpen = 4;
+		int gapExtend = 2;
+
+		thread_local ThreadMemPool buf;
+		buf.cleanIter();
+
+		//substitution matrix
+		int8_t a = matchScore;
+		int8_t b = misScore < 0 ? misScore : -misScore; // a > 0 and b < 0
+		int8_t subsMat[] = {a, b, b, b, 0, 
+							b, a, b, b, 0, 
+							b, b, a, b, 0, 
+							b, b, b, a, 0, 
+							0, 0, 0, 0, 0};
+
+		const int NUM_NUCL = 5;
+		const int Z_DROP = -1;
+		const int FLAG = KSW_EZ_APPROX_MAX | KSW_EZ_APPROX_DROP;
+		const int END_BONUS = 0;
 	
-	//int seqDiff = abs((int)trgByte.size() - (int)qryByte.size());
-	//int bandWidth = seqDiff + MAX_JUMP;
-	//int bandWidth = std::max(10.0f, maxAlnErr * std::max(trgLen, qryLen));
-	(void)maxAlnErr;
-
-	//dynamic band selection
-	ksw_extz_t ez;
-	int bandWidth = 64;
-	for (;;)
-	{
-		memset(&ez, 0, sizeof(ksw_extz_t));
-		ksw_extz2_sse(buf.memPool, qryByte.size(), &qryByte[0], 
-					  trgByte.size(), &trgByte[0], NUM_NUCL,
-					  subsMat, gapOpen, gapExtend, bandWidth, Z_DROP, 
-					  END_BONUS, FLAG, &ez);
-		if (!ez.zdropped)
+		//int seqDiff = abs((int)trgByte.size() - (int)qryByte.size());
+		//int bandWidth = seqDiff + MAX_JUMP;
+		//int bandWidth = std::max(10.0f, maxAlnErr * std::max(trgLen, qryLen));
+		(void)maxAlnErr;
+
+		//dynamic band selection
+		ksw_extz_t ez;
+		int bandWidth = 64;
+		for (;;)
 		{
-			//check deviation from the diagonal
-			int64_t deviation = 0;
-			for (size_t i = 0; i < (size_t)ez.n_cigar; ++i)
-			{
-				int32_t size = ez.cigar[i] >> 4;
-				char op = "MID"[ez.cigar[i] & 0xf];
-				if (op == 'I') deviation += size;
-				if (op == 'D') deviation -= size;
-			}
-			if (labs(deviation) > bandWidth)	//looks like this never happens
+			memset(&ez, 0, sizeof(ksw_extz_t));
+			ksw_extz2_sse(buf.memPool, qryByte.size(), &qryByte[0], 
+						  trgByte.size(), &trgByte[0], NUM_NUCL,
+						  subsMat, gapOpen, gapExtend, bandWidth, Z_DROP, 
+						  END_BONUS, FLAG, &ez);
+			if (!ez.zdropped)
 			{
-				Logger::get().warning() << "Deviation: " << deviation << " " << bandWidth;
+				//check deviation from the diagonal
+				int64_t deviation = 0;
+				for (size_t i = 0; i < (size_t)ez.n_cigar; ++i)
+				{
+					int32_t size = ez.cigar[i] >> 4;
+					char op = "MID"[ez.cigar[i] & 0xf];
+					if (op == 'I') deviation += size;
+					if (op == 'D') deviation -= size;
+				}
+				if (labs(deviation) > bandWidth)	//looks like this never happens
+				{
+					Logger::get().warning() << "Deviation: " << deviation << " " << bandWidth;
+				}
+				if (labs(deviation) <= bandWidth) break;
 			}
-			if (labs(deviation) <= bandWidth) break;
-		}
 
-		if (bandWidth > (int)std::max(qryByte.size(), trgByte.size())) break; //just in case
-		bandWidth *= 2;
-	}
+			if (bandWidth > (int)std::max(qryByte.size(), trgByte.size())) break; //just in case
+			bandWidth *= 2;
+		}
 
-	/*static std::mutex logMut;
-	if (qryByte.size() > 20000 || trgByte.size() > 20000)
-	{
-		logMut.lock();
-		Logger::get().debug() << "Aln: " << qryByte.size() << " " 
-			<< trgByte.size() << " " << bandWidth;
-		logMut.unlock();
-	}*/
+		/*static std::mutex logMut;
+		if (qryByte.size() > 20000 || trgByte.size() > 20000)
+		{
+			logMut.lock();
+			Logger::get().debug() << "Aln: " << qryByte.size() << " " 
+				<< trgByte.size() << " " << bandWidth;
+			logMut.unlock();
+		}*/
 	
-	int numMatches = 0;
-	int numMiss = 0;
-	int numIndels = 0;
+		int numMatches = 0;
+		int numMiss = 0;
+		int numIndels = 0;
 
-	cigarOut.clear();
-	cigarOut.reserve((size_t)ez.n_cigar);
+		cigarOut.clear();
+		cigarOut.reserve((size_t)ez.n_cigar);
 
-	//decode cigar
-	size_t posQry = 0;
-	size_t posTrg = 0;
-	for (size_t i = 0; i < (size_t)ez.n_cigar; ++i)
-	{
-		int size = ez.cigar[i] >> 4;
-		char op = "MID"[ez.cigar[i] & 0xf];
-		//alnLength += size;
-
-		if (op == 'M')
+		//decode cigar
+		size_t posQry = 0;
+		size_t posTrg = 0;
+		for (size_t i = 0; i < (size_t)ez.n_cigar; ++i)
 		{
-			for (size_t i = 0; i < (size_t)size; ++i)
+			int size = ez.cigar[i] >> 4;
+			char op = "MID"[ez.cigar[i] & 0xf];
+			//alnLength += size;
+
+			if (op == 'M')
 			{
-				char match = "X="[size_t(trgByte[posTrg + i] == 
-										 qryByte[posQry + i])];
-				if (i == 0 || (match != cigarOut.back().op))
+				for (size_t i = 0; i < (size_t)size; ++i)
 				{
-					cigarOut.push_back({match, 1});
+					char match = "X="[size_t(trgByte[posTrg + i] == 
+											 qryByte[posQry + i])];
+					if (i == 0 || (match != cigarOut.back().op))
+					{
+						cigarOut.push_back({match, 1});
+					}
+					else
+					{
+						++cigarOut.back().len;
+					}
+					numMatches += int(match == '=');
+					numMiss += int(match == 'X');
 				}
-				else
-				{
-					++cigarOut.back().len;
-				}
-				numMatches += int(match == '=');
-				numMiss += int(match == 'X');
+				posQry += size;
+				posTrg += size;
+			}
+			else if (op == 'I')
+			{
+				cigarOut.push_back({'I', size});
+				posQry += size;
+				numIndels += size;
+			}
+			else //D
+			{
+				cigarOut.push_back({'D', size});
+				posTrg += size;
+				numIndels += size;
 			}
-			posQry += size;
-			posTrg += size;
-		}
-		else if (op == 'I')
-		{
-			cigarOut.push_back({'I', size});
-			posQry += size;
-			numIndels += size;
 		}
-		else //D
+		//float errRate = 1 - float(numMatches) / (numMatches + numMiss + numIndels);
+		float errRate = float(numMiss + numIndels) / 
+						 std::max(trgByte.size(), qryByte.size());
+
+		kfree(buf.memPool, ez.cigar);
+		return errRate;
+	}
+
+	//nucleotide codes of a decoded (e.g. HPC) sequence
+	void encodeNucl(const std::string& seq, std::vector<uint8_t>& outCodes)
+	{
+		outCodes.resize(seq.size());
+		for (size_t i = 0; i < seq.size(); ++i)
 		{
-			cigarOut.push_back({'D', size});
-			posTrg += size;
-			numIndels += size;
+			outCodes[i] = DnaSequence::dnaToId(seq[i]);
 		}
 	}
-	//float errRate = 1 - float(numMatches) / (numMatches + numMiss + numIndels);
-	float errRate = float(numMiss + numIndels) / std::max(trgLen, qryLen);
+}
 
-	kfree(buf.memPool, ez.cigar);
-	return errRate;
+float getAlignmentCigarKsw(const DnaSequence& trgSeq, size_t trgBegin, size_t trgLen,
+			   			   const DnaSequence& qrySeq, size_t qryBegin, size_t qryLen,
+			   			   float maxAlnErr, std::vector<CigOp>& cigarOut)
+{
+	thread_local std::vector<uint8_t> trgByte;
+	thread_local std::vector<uint8_t> qryByte;
+	trgByte.assign(trgLen, 0);
+	qryByte.assign(qryLen, 0);
+
+	for (size_t i = 0; i < trgLen; ++i)
+	{
+		trgByte[i] = trgSeq.atRaw(i + trgBegin);
+	}
+	for (size_t i = 0; i < qryLen; ++i)
+	{
+		qryByte[i] = qrySeq.atRaw(i + qryBegin);
+	}
+
+	return getCodesCigarKsw(trgByte, qryByte, maxAlnErr, cigarOut);
 }
 
-float getAlignmentErrEdlib(const OverlapRange& ovlp, const DnaSequence& trgSeq,
-					  	   const DnaSequence& qrySeq, float maxAlnErr, bool useHpc)
+float getAlignmentErrEdlib(const OverlapRange& ovlp, 
+						   const SequenceContainer& curContainer,
+					  	   const SequenceContainer& extContainer, 
+						   float maxAlnErr, bool useHpc)
 {
 	thread_local ThreadMemPool buf;
+	thread_local CompressedSeq trgCompressed;
+	thread_local CompressedSeq qryCompressed;
 	buf.cleanIter();
 
-	auto trgCompressed = homopolymerCompression(trgSeq, ovlp.curBegin, 
-												ovlp.curRange(), useHpc);
-	auto qryCompressed = homopolymerCompression(qrySeq, ovlp.extBegin, 
-												ovlp.extRange(), useHpc);
+	compressRegion(curContainer, ovlp.curId, ovlp.curBegin, 
+				   ovlp.curRange(), useHpc, trgCompressed);
+	compressRegion(extContainer, ovlp.extId, ovlp.extBegin, 
+				   ovlp.extRange(), useHpc, qryCompressed);
 
 	(void)maxAlnErr;
 	//int bandWidth = std::max(10.0f, maxAlnErr * std::max(ovlp.curRange(), 
@@ -258,8 +298,8 @@ float getAlignmentErrEdlib(const OverlapRange& ovlp, const DnaSequence& trgSeq,
 	//it is in fact a little faster, than having a hard upper limit.
 	auto edlibCfg = edlibNewAlignConfig(-1, EDLIB_MODE_NW, 
 										EDLIB_TASK_DISTANCE, nullptr, 0);
-	auto result = edlibAlign(&qryCompressed.seq.str().c_str()[0], qryCompressed.seq.length(),
-							 &trgCompressed.seq.str().c_str()[0], trgCompressed.seq.length(), 
+	auto result = edlibAlign(qryCompressed.seq.c_str(), qryCompressed.seq.length(),
+							 trgCompressed.seq.c_str(), trgCompressed.seq.length(), 
 							 edlibCfg);
 	//Logger::get().debug() << result.editDistance << " " << result.alignmentLength;
 	if (result.editDistance < 0)
@@ -306,21 +346,21 @@ void decodeCigar(const std::vector<CigOp>& cigar,
 		{
 			//alnQry += strQ.substr(posQry, op.len);
 			//alnTrg += strT.substr(posTrg, op.len);
-			outAlnQry += qrySeq.substr(qryBegin + posQry, op.len).str();
-			outAlnTrg += trgSeq.substr(trgBegin + posTrg, op.len).str();
+			outAlnQry += qrySeq.str(qryBegin + posQry, op.len);
+			outAlnTrg += trgSeq.str(trgBegin + posTrg, op.len);
 			posQry += op.len;
 			posTrg += op.len;
 		}
 		else if (op.op == 'I')
 		{
-			outAlnQry += qrySeq.substr(qryBegin + posQry, op.len).str();
+			outAlnQry += qrySeq.str(qryBegin + posQry, op.len);
 			outAlnTrg += std::string(op.len, '-');
 			posQry += op.len;
 		}
 		else
 		{
 			outAlnQry += std::string(op.len, '-');
-			outAlnTrg += trgSeq.substr(trgBegin + posTrg, op.len).str();
+			outAlnTrg += trgSeq.str(trgBegin + posTrg, op.len);
 			posTrg += op.len;
 		}
 	}
@@ -329,21 +369,27 @@ void decodeCigar(const std::vector<CigOp>& cigar,
 
 
 std::vector<OverlapRange> 
-	checkIdyAndTrim(OverlapRange& ovlp, const DnaSequence& curSeq,
-					const DnaSequence& extSeq, float maxDivergence,
+	checkIdyAndTrim(OverlapRange& ovlp, const SequenceContainer& curContainer,
+					const SequenceContainer& extContainer, float maxDivergence,
 					int32_t minOverlap, bool useHpc)
 {
 	//homopolymer-compressed, if needed
-	auto curCompressed = homopolymerCompression(curSeq, ovlp.curBegin, 
-												ovlp.curRange(), useHpc);
-	auto extCompressed = homopolymerCompression(extSeq, ovlp.extBegin, 
-												ovlp.extRange(), useHpc);
+	thread_local CompressedSeq curCompressed;
+	thread_local CompressedSeq extCompressed;
+	compressRegion(curContainer, ovlp.curId, ovlp.curBegin, 
+				   ovlp.curRange(), useHpc, curCompressed);
+	compressRegion(extContainer, ovlp.extId, ovlp.extBegin, 
+				   ovlp.extRange(), useHpc, extCompressed);
+	//the regions are aligned from the reused code buffers,
+	//without packing them into new sequences
+	thread_local std::vector<uint8_t> curCodes;
+	thread_local std::vector<uint8_t> extCodes;
+	encodeNucl(curCompressed.seq, curCodes);
+	encodeNucl(extCompressed.seq, extCodes);
 
 	//recompute base alignment with cigar output
 	std::vector<CigOp> cigar;
-	float errRate = getAlignmentCigarKsw(curCompressed.seq, 0, curCompressed.seq.length(),
-							 			 extCompressed.seq, 0, extCompressed.seq.length(),
-							 			 maxDivergence, cigar);
+	float errRate = getCodesCigarKsw(curCodes, extCodes, maxDivergence, cigar);
 	(void)errRate;
 
 	/*if (errRate < maxDivergence) 	//should not normally happen
@@ -12,15 +12,17 @@ float getAlignmentErrKsw(const OverlapRange& ovlp,
 					  	 const DnaSequence& qrySeq,
 					  	 float maxAlnErr);
 
+//the overlap sequences are taken from the containers by
+//curId / extId. Precomputed HPC indexes are used, if available
 float getAlignmentErrEdlib(const OverlapRange& ovlp,
-					  	   const DnaSequence& trgSeq,
-					  	   const DnaSequence& qrySeq,
+					  	   const SequenceContainer& curContainer,
+					  	   const SequenceContainer& extContainer,
 						   float maxAlnErr,
 						   bool useHpc);
 
 std::vector<OverlapRange> 
-	checkIdyAndTrim(OverlapRange& ovlp, const DnaSequence& curSeq,
-					const DnaSequence& extSeq, float maxDivergence,
+	checkIdyAndTrim(OverlapRange& ovlp, const SequenceContainer& curContainer,
+					const SequenceContainer& extContainer, float maxDivergence,
 					int32_t minOverlap, bool useHpc);
 
 struct CigOp
@@ -68,7 +68,7 @@ FastaRecord ConsensusGenerator::generateLinear(const ContigPath& path,
 
 		if (rightCut - leftCut > 0)	//shoudn't happen, but just in case
 		{
-			contigSequence += sequence.substr(leftCut, rightCut - leftCut).str();
+			contigSequence += sequence.str(leftCut, rightCut - leftCut);
 			//Logger::get().debug() << "\tPiece " << sequence.length() << " " 
 			//	<< leftCut << " " << rightCut << " " << rightCut - path.overlaps[i].curBegin;
 		}
@@ -0,0 +1,122 @@
+//(c) 2020 by Authors
+//This file is a part of Flye program.
+//Released under the BSD license (see LICENSE file)
+
+#include "hpc_sequence.h"
+
+namespace
+{
+	//bits of the word that correspond to the positions [low, high]
+	uint64_t rangeMask(size_t wordId, size_t low, size_t high)
+	{
+		uint64_t mask = ~0ULL;
+		if (wordId == low / 64) mask &= ~0ULL << (low % 64);
+		if (wordId == high / 64) mask &= ~0ULL >> (63 - high % 64);
+		return mask;
+	}
+}
+
+HpcSequence::HpcSequence(const DnaSequence& sequence):
+	_length(sequence.length())
+{
+	_runStarts.assign(_length / 64 + 1, 0);
+	const std::string nucleotides = sequence.str();
+	std::string runs;
+	for (size_t i = 0; i < _length; ++i)
+	{
+		if (i == 0 || nucleotides[i] != nucleotides[i - 1])
+		{
+			runs += nucleotides[i];
+			_runStarts[i / 64] |= 1ULL << (i % 64);
+		}
+	}
+	_runs = DnaSequence(runs);
+
+	size_t numRuns = 0;
+	for (size_t i = 0; i < _runStarts.size(); ++i)
+	{
+		if (i % WORDS_IN_BLOCK == 0) _blockRanks.push_back(numRuns);
+		numRuns += __builtin_popcountll(_runStarts[i]);
+	}
+}
+
+size_t HpcSequence::rank(size_t pos) const
+{
+	const size_t lastWord = pos / 64;
+	size_t result = _blockRanks[lastWord / WORDS_IN_BLOCK];
+	for (size_t i = lastWord - lastWord % WORDS_IN_BLOCK; i < lastWord; ++i)
+	{
+		result += __builtin_popcountll(_runStarts[i]);
+	}
+	if (pos % 64)
+	{
+		result += __builtin_popcountll(_runStarts[lastWord] &
+									   (~0ULL >> (64 - pos % 64)));
+	}
+	return result;
+}
+
+void HpcSequence::extract(bool complement, size_t start, size_t length,
+						  std::string& outSeq,
+						  std::vector<int32_t>& outOffsets) const
+{
+	outSeq.clear();
+	outOffsets.clear();
+	if (length == 0) return;
+
+	if (!complement)
+	{
+		//the run that contains the first base, then all runs
+		//that start within the region
+		const size_t end = start + length;
+		size_t run = this->rank(start + 1) - 1;
+		outSeq.push_back(DnaSequence::idToDna(_runs.atRaw(run)));
+		outOffsets.push_back(0);
+		if (length == 1) return;
+
+		for (size_t w = (start + 1) / 64; w <= (end - 1) / 64; ++w)
+		{
+			uint64_t word = _runStarts[w] & rangeMask(w, start + 1, end - 1);
+			while (word)
+			{
+				const size_t pos = w * 64 + __builtin_ctzll(word);
+				++run;
+				outSeq.push_back(DnaSequence::idToDna(_runs.atRaw(run)));
+				outOffsets.push_back(pos - start);
+				word &= word - 1;
+			}
+		}
+	}
+	else
+	{
+		//same region on the forward strand, traversed backwards.
+		//On the reverse strand, a run starts where the forward one ends
+		const size_t fwdStart = _length - start - length;
+		const size_t fwdEnd = _length - start;
+		size_t run = this->rank(fwdEnd) - 1;
+		outSeq.push_back(DnaSequence::idToDna(~_runs.atRaw(run) & 3));
+		outOffsets.push_back(0);
+		if (length == 1) return;
+
+		for (size_t w = (fwdEnd - 1) / 64 + 1; w-- > (fwdStart + 1) / 64; )
+		{
+			uint64_t word = _runStarts[w] &
+							rangeMask(w, fwdStart + 1, fwdEnd - 1);
+			while (word)
+			{
+				const size_t bit = 63 - __builtin_clzll(word);
+				--run;
+				outSeq.push_back(DnaSequence::idToDna(~_runs.atRaw(run) & 3));
+				outOffsets.push_back(fwdEnd - (w * 64 + bit));
+				word &= ~(1ULL << bit);
+			}
+		}
+	}
+}
+
+size_t HpcSequence::memoryUsage() const
+{
+	return DnaSequence::numChunks(_runs.length()) * sizeof(DnaSequence::NuclType) +
+		   _runStarts.size() * sizeof(uint64_t) +
+		   _blockRanks.size() * sizeof(uint32_t);
+}
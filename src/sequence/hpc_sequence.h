@@ -0,0 +1,49 @@
+//(c) 2020 by Authors
+//This file is a part of Flye program.
+//Released under the BSD license (see LICENSE file)
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdint>
+
+#include "sequence.h"
+
+//Homopolymer-compressed (HPC) representation of a sequence.
+//Stores one nucleotide per homopolymer run, a bit vector that marks
+//the first base of each run, and the number of runs before
+//every checkpoint block of the bit vector. Both strands are
+//served by the same object.
+class HpcSequence
+{
+public:
+	HpcSequence(): _length(0) {}
+	explicit HpcSequence(const DnaSequence& sequence);
+
+	size_t length() const {return _length;}
+	size_t numRuns() const {return _runs.length();}
+
+	//HPC representation of the region [start, start + length)
+	//of the sequence (or of its reverse complement). The first
+	//nucleotide of each run is output, along with its offset from
+	//the region start. Output buffers are cleared, but not deallocated
+	void extract(bool complement, size_t start, size_t length,
+				 std::string& outSeq, std::vector<int32_t>& outOffsets) const;
+
+	size_t memoryUsage() const;
+
+private:
+	static const size_t WORDS_IN_BLOCK = 8;
+
+	bool isRunStart(size_t pos) const
+		{return (_runStarts[pos / 64] >> (pos % 64)) & 1;}
+
+	//number of runs that start at the positions [0, pos)
+	size_t rank(size_t pos) const;
+
+	size_t _length;
+	DnaSequence _runs;
+	std::vector<uint64_t> _runStarts;
+	std::vector<uint32_t> _blockRanks;
+};
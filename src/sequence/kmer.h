@@ -6,7 +6,6 @@
 
 #include <unordered_map>
 #include <memory>
-#include <deque>
 
 #include "sequence_container.h"
 #include "../common/config.h"
@@ -36,19 +35,13 @@ public:
 		}
 	}
 
-	Kmer reverseComplement()
+	//the whole word is reverse-complemented at once,
+	//then the k-mer is shifted back to the lower bits
+	Kmer reverseComplement() const
 	{
-		KmerRepr tmpRepr = _representation;
-		Kmer newKmer;
-
-		for (unsigned int i = 0; i < Parameters::get().kmerSize; ++i)
-		{
-			newKmer._representation <<= 2;
-			newKmer._representation += ~tmpRepr & 3;
-			tmpRepr >>= 2;
-		}
-
-		return newKmer;
+		const size_t shift = sizeof(KmerRepr) * 8 - 
+							 Parameters::get().kmerSize * 2;
+		return Kmer(DnaSequence::reverseComplementChunk(_representation) >> shift);
 	}
 
 	bool standardForm()
@@ -102,7 +95,7 @@ public:
 		return _representation < other._representation;
 	}
 
-	size_t numRepr() {return _representation;}
+	size_t numRepr() const {return _representation;}
 
 private:
 	KmerRepr _representation;
@@ -174,6 +167,110 @@ protected:
 };
 
 
+//k-mer in the canonical form (the smaller of the two strands),
+//its position on the sequence and whether it was reverse-complemented
+struct CanonicalKmerPosition
+{
+	CanonicalKmerPosition(Kmer kmer, int32_t position, bool revComp):
+		kmer(kmer), position(position), revComp(revComp) {}
+	Kmer kmer;
+	int32_t position;
+	bool revComp;
+};
+
+//Rolls both the forward k-mer and its reverse complement, so that
+//the canonical form is obtained in O(1) per base. The k-mer size
+//is fixed at construction
+class CanonicalKmerIterator
+{
+public:
+    typedef std::forward_iterator_tag iterator_category;
+
+	CanonicalKmerIterator(const DnaSequence* readSeq, size_t position,
+						  size_t kmerSize):
+		_readSeq(readSeq),
+		_position(position),
+		_kmerMask(((Kmer::KmerRepr)1 << kmerSize * 2) - 1),
+		_complShift(kmerSize * 2 - 2),
+		_kmerSize(kmerSize),
+		_forward(0),
+		_complement(0)
+	{
+		if (position + kmerSize > readSeq->length()) return;
+		for (size_t i = position; i < position + kmerSize; ++i)
+		{
+			this->append(readSeq->atRaw(i));
+		}
+	}
+
+	bool operator==(const CanonicalKmerIterator& other) const
+	{
+		return _readSeq == other._readSeq && _position == other._position;
+	}
+
+	bool operator!=(const CanonicalKmerIterator& other) const
+	{
+		return !(*this == other);
+	}
+
+	CanonicalKmerPosition operator*() const
+	{
+		const bool revComp = _complement < _forward;
+		return CanonicalKmerPosition(Kmer(revComp ? _complement : _forward), 
+									 _position, revComp);
+	}
+
+	CanonicalKmerIterator& operator++()
+	{
+		this->append(_readSeq->atRaw(_position + _kmerSize));
+		++_position;
+		return *this;
+	}
+
+private:
+	void append(DnaSequence::NuclType dnaSymbol)
+	{
+		_forward = ((_forward << 2) | dnaSymbol) & _kmerMask;
+		_complement = (_complement >> 2) | 
+			((Kmer::KmerRepr)(~dnaSymbol & 3) << _complShift);
+	}
+
+	const DnaSequence* _readSeq;
+	size_t 	_position;
+	const Kmer::KmerRepr _kmerMask;
+	const size_t _complShift;
+	const size_t _kmerSize;
+	Kmer::KmerRepr _forward;
+	Kmer::KmerRepr _complement;
+};
+
+//Same range as IterKmers, but yields the canonical k-mers
+class IterCanonicalKmers
+{
+public:
+	IterCanonicalKmers(const DnaSequence& sequence,
+					   size_t kmerSize = Parameters::get().kmerSize):
+		_sequence(sequence), _kmerSize(kmerSize)
+	{}
+
+	CanonicalKmerIterator begin()
+	{
+		if (_sequence.length() < _kmerSize) return this->end();
+		return CanonicalKmerIterator(&_sequence, 0, _kmerSize);
+	}
+
+	CanonicalKmerIterator end()
+	{
+		const size_t endPos = _sequence.length() >= _kmerSize ? 
+							  _sequence.length() - _kmerSize : 0;
+		return CanonicalKmerIterator(&_sequence, endPos, _kmerSize);
+	}
+
+private:
+	const DnaSequence& _sequence;
+	const size_t _kmerSize;
+};
+
 class IterKmers
 {
 public:
@@ -203,60 +300,253 @@ private:
 	const size_t _length;
 };
 
-inline std::vector<KmerPosition> yieldMinimizers(const DnaSequence& sequence, int window)
+//Minimizers of the windows of "window" consecutive k-mers (in the canonical
+//form) are written into the provided buffer. The k-mers are rolled from
+//the packed sequence in blocks, then hashed in a separate loop without
+//dependencies between iterations, so it is pipelined / vectorized.
+//The last k-mers are kept in a ring buffer: the current minimum
+//is only replaced by a strictly smaller hash, and once it leaves
+//the window, the window is rescanned and the rightmost minimum is taken
+inline void yieldMinimizers(const DnaSequence& sequence, int window,
+							std::vector<CanonicalKmerPosition>& minimizers)
 {
 	if (window < 1) throw std::runtime_error("wrong minimizer length");
 
-	struct KmerAndHash
+	minimizers.clear();
+	const size_t kmerSize = Parameters::get().kmerSize;
+	//same range as IterCanonicalKmers
+	if (sequence.length() <= kmerSize) return;
+	const size_t numKmers = sequence.length() - kmerSize;
+	minimizers.reserve(window > 1 ? numKmers / window * 3 : numKmers);
+
+	typedef DnaSequence::NuclType NuclType;
+	const size_t NUCL_IN_CHUNK = sizeof(NuclType) * 4;
+	thread_local std::vector<NuclType> chunkBuffer;
+	sequence.packedChunks(chunkBuffer);
+	const NuclType* chunks = chunkBuffer.data();
+	auto nuclAt = [chunks](size_t pos)
 	{
-		KmerPosition kp;
-		size_t hash;
+		return (chunks[pos / NUCL_IN_CHUNK] >> (pos % NUCL_IN_CHUNK) * 2) & 3;
 	};
-	thread_local std::deque<KmerAndHash> miniQueue;
-	miniQueue.clear();
 
-	std::vector<KmerPosition> minimizers;
-	const size_t expectedSize = sequence.length() / window * 2;
-	minimizers.reserve(1.5 * expectedSize);
+	struct RingEntry
+	{
+		size_t hash;
+		Kmer::KmerRepr kmer;
+		bool revComp;
+	};
+	//k-mer at a position is stored at (position % ringSize)
+	size_t ringSize = 1;
+	while (ringSize < (size_t)window) ringSize *= 2;
+	const size_t ringMask = ringSize - 1;
+	thread_local std::vector<RingEntry> ringBuffer;
+	if (ringBuffer.size() < ringSize) ringBuffer.resize(ringSize);
+	RingEntry* ring = ringBuffer.data();
+	size_t minHash = (size_t)-1;
+	int32_t minPosition = -window - 1;
+	int32_t lastPosition = -1;
+
+	const Kmer::KmerRepr kmerMask = ((Kmer::KmerRepr)1 << kmerSize * 2) - 1;
+	const size_t complShift = kmerSize * 2 - 2;
+	Kmer::KmerRepr forward = 0;
+	Kmer::KmerRepr complement = 0;
+	for (size_t i = 0; i < kmerSize - 1; ++i)
+	{
+		const NuclType nucl = nuclAt(i);
+		forward = ((forward << 2) | nucl) & kmerMask;
+		complement = (complement >> 2) | ((~nucl & 3) << complShift);
+	}
 
-	if (window == 1)
+	const size_t BLOCK_SIZE = 256;
+	Kmer::KmerRepr blockKmers[BLOCK_SIZE];
+	bool blockRevComp[BLOCK_SIZE];
+	size_t blockHashes[BLOCK_SIZE];
+	for (size_t blockStart = 0; blockStart < numKmers; blockStart += BLOCK_SIZE)
 	{
-		for (auto kmerPos : IterKmers(sequence))
+		const size_t blockLen = std::min(BLOCK_SIZE, numKmers - blockStart);
+		for (size_t i = 0; i < blockLen; ++i)
 		{
-			minimizers.push_back(kmerPos);
+			const NuclType nucl = nuclAt(blockStart + i + kmerSize - 1);
+			forward = ((forward << 2) | nucl) & kmerMask;
+			complement = (complement >> 2) | ((~nucl & 3) << complShift);
+			blockRevComp[i] = complement < forward;
+			blockKmers[i] = blockRevComp[i] ? complement : forward;
 		}
-		return minimizers;
-	}
 
-	for (auto kmerPos : IterKmers(sequence))
-	{
-		auto stdKmer = kmerPos.kmer;
-		stdKmer.standardForm();
-		size_t curHash = stdKmer.hash();
-		
-		while (!miniQueue.empty() && miniQueue.back().hash > curHash)
+		if (window == 1)
 		{
-			miniQueue.pop_back();
+			for (size_t i = 0; i < blockLen; ++i)
+			{
+				minimizers.emplace_back(Kmer(blockKmers[i]), blockStart + i,
+										blockRevComp[i]);
+			}
+			continue;
 		}
-		miniQueue.push_back({kmerPos, curHash});
-		if (miniQueue.front().kp.position <= kmerPos.position - window)
+
+		for (size_t i = 0; i < blockLen; ++i)
 		{
-			while (miniQueue.front().kp.position <= kmerPos.position - window)
+			blockHashes[i] = Kmer(blockKmers[i]).hash();
+		}
+
+		for (size_t i = 0; i < blockLen; ++i)
+		{
+			const int32_t position = blockStart + i;
+			const size_t curHash = blockHashes[i];
+			ring[position & ringMask] = {curHash, blockKmers[i], blockRevComp[i]};
+
+			if (curHash < minHash)
 			{
-				miniQueue.pop_front();
+				minHash = curHash;
+				minPosition = position;
 			}
-			while (miniQueue.size() >= 2 && miniQueue[0].hash == miniQueue[1].hash)
+			else if (minPosition <= position - window)
+			{
+				minHash = (size_t)-1;
+				for (int32_t pos = std::max(0, position - window + 1); 
+					 pos <= position; ++pos)
+				{
+					const size_t hash = ring[pos & ringMask].hash;
+					minPosition = hash <= minHash ? pos : minPosition;
+					minHash = std::min(minHash, hash);
+				}
+			}
+
+			if (minPosition != lastPosition)
+			{
+				const RingEntry& minEntry = ring[minPosition & ringMask];
+				minimizers.emplace_back(Kmer(minEntry.kmer), minPosition, 
+										minEntry.revComp);
+				lastPosition = minPosition;
+			}
+		}
+	}
+}
+
+//Syncmers are the k-mers (in the canonical form) whose smallest
+//canonical s-mer is located at the given offsets within the k-mer:
+//at the first or the last s-mer for closed syncmers, in the middle
+//for open syncmers. The offsets are symmetric, so the same k-mers are
+//selected on both strands, and the selection does not depend on
+//the flanking sequence (unlike minimizers). Each k-mer contains 
+//"window" s-mers, so the closed syncmer density is 2 / window (close to
+//the minimizers with the same window). Open syncmer density is 1 / window
+//for odd windows, and 2 / window for even (two middle offsets are used)
+inline void yieldSyncmers(const DnaSequence& sequence, int window, bool closed,
+						  std::vector<CanonicalKmerPosition>& syncmers)
+{
+	const size_t kmerSize = Parameters::get().kmerSize;
+	if (window < 1 || (size_t)window > kmerSize) 
+	{
+		throw std::runtime_error("wrong syncmer window");
+	}
+
+	syncmers.clear();
+	//same range as IterCanonicalKmers
+	if (sequence.length() <= kmerSize) return;
+	const size_t numKmers = sequence.length() - kmerSize;
+	syncmers.reserve(numKmers / window * 3);
+
+	typedef DnaSequence::NuclType NuclType;
+	const size_t NUCL_IN_CHUNK = sizeof(NuclType) * 4;
+	thread_local std::vector<NuclType> chunkBuffer;
+	sequence.packedChunks(chunkBuffer);
+	const NuclType* chunks = chunkBuffer.data();
+
+	//hashes of the last s-mers, s-mer at a position is stored
+	//at (position % ringSize)
+	size_t ringSize = 1;
+	while (ringSize < (size_t)window) ringSize *= 2;
+	const size_t ringMask = ringSize - 1;
+	size_t smerHashes[sizeof(Kmer::KmerRepr) * 4];
+
+	const size_t smerSize = kmerSize - window + 1;
+	const size_t firstOffset = closed ? 0 : (window - 1) / 2;
+	const size_t lastOffset = window - 1 - firstOffset;
+
+	const Kmer::KmerRepr kmerMask = ((Kmer::KmerRepr)1 << kmerSize * 2) - 1;
+	const size_t kmerComplShift = kmerSize * 2 - 2;
+	const Kmer::KmerRepr smerMask = ((Kmer::KmerRepr)1 << smerSize * 2) - 1;
+	const size_t smerComplShift = smerSize * 2 - 2;
+	Kmer::KmerRepr forward = 0;
+	Kmer::KmerRepr complement = 0;
+	Kmer::KmerRepr smerForward = 0;
+	Kmer::KmerRepr smerComplement = 0;
+	size_t minHash = (size_t)-1;
+	int64_t minPosition = -window - 1;
+	for (size_t pos = 0; pos < numKmers + kmerSize - 1; ++pos)
+	{
+		const NuclType nucl = (chunks[pos / NUCL_IN_CHUNK] >> 
+							   (pos % NUCL_IN_CHUNK) * 2) & 3;
+		forward = ((forward << 2) | nucl) & kmerMask;
+		complement = (complement >> 2) | ((~nucl & 3) << kmerComplShift);
+		smerForward = ((smerForward << 2) | nucl) & smerMask;
+		smerComplement = (smerComplement >> 2) | ((~nucl & 3) << smerComplShift);
+		if (pos + 1 < smerSize) continue;
+
+		//sliding minimum over the s-mers of the current k-mer
+		const int64_t smerPos = pos + 1 - smerSize;
+		const size_t curHash = Kmer(std::min(smerForward, smerComplement)).hash();
+		smerHashes[smerPos & ringMask] = curHash;
+		if (curHash <= minHash)
+		{
+			minHash = curHash;
+			minPosition = smerPos;
+		}
+		else if (minPosition <= smerPos - window)
+		{
+			minHash = (size_t)-1;
+			for (int64_t i = std::max((int64_t)0, smerPos - window + 1); 
+				 i <= smerPos; ++i)
 			{
-				miniQueue.pop_front();
+				const size_t hash = smerHashes[i & ringMask];
+				minPosition = hash <= minHash ? i : minPosition;
+				minHash = std::min(minHash, hash);
 			}
 		}
-		if (minimizers.empty() || minimizers.back().position != 
-								  miniQueue.front().kp.position)
+		if (pos + 1 < kmerSize) continue;
+
+		const int64_t kmerPos = pos + 1 - kmerSize;
+		if (minHash == smerHashes[(kmerPos + firstOffset) & ringMask] ||
+			minHash == smerHashes[(kmerPos + lastOffset) & ringMask])
 		{
-			minimizers.push_back(miniQueue.front().kp);
+			const bool revComp = complement < forward;
+			syncmers.emplace_back(Kmer(revComp ? complement : forward), 
+								  kmerPos, revComp);
 		}
 	}
+}
+
+//k-mer sampling schemes for the index ("kmer_sampling" parameter)
+enum KmerSampling
+{
+	//minimizers with the robust winnowing tie breaking
+	SAMPLING_MINIMIZERS = 0,
+	SAMPLING_OPEN_SYNCMERS = 1,
+	SAMPLING_CLOSED_SYNCMERS = 2
+};
+
+inline const char* samplingName(int scheme)
+{
+	switch (scheme)
+	{
+	case SAMPLING_MINIMIZERS: return "minimizers";
+	case SAMPLING_OPEN_SYNCMERS: return "open syncmers";
+	case SAMPLING_CLOSED_SYNCMERS: return "closed syncmers";
+	}
+	throw std::runtime_error("wrong k-mer sampling scheme");
+}
 
-	//Logger::get().debug() << _seqContainer.seqLen(seqId) << " " << minimizers.size();
-	return minimizers;
+//samples the k-mers using the given scheme and window. With window = 1,
+//all k-mers are taken
+inline void yieldSampledKmers(const DnaSequence& sequence, int scheme, int window,
+							  std::vector<CanonicalKmerPosition>& kmers)
+{
+	if (window == 1 || scheme == SAMPLING_MINIMIZERS)
+	{
+		yieldMinimizers(sequence, window, kmers);
+	}
+	else
+	{
+		yieldSyncmers(sequence, window, scheme == SAMPLING_CLOSED_SYNCMERS, kmers);
+	}
 }
@@ -0,0 +1,78 @@
+//(c) 2020 by Authors
+//This file is a part of Flye program.
+//Released under the BSD license (see LICENSE file)
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <cstdint>
+
+#include "kmer.h"
+
+//Two-level blocked Bloom filter that detects k-mers that were
+//inserted at least twice. Each k-mer is mapped to a single 64-bit word:
+//the lower half stores the first level bits (k-mer was seen),
+//the upper half - the second level bits (k-mer was seen again).
+//There are no false negatives, so all repeated k-mers pass the filter,
+//along with a small fraction of singletons. Thread-safe.
+class RepeatedKmerFilter
+{
+public:
+	//the number of words is rounded down to a power of two
+	explicit RepeatedKmerFilter(size_t numWords):
+		_numWords(1)
+	{
+		while (_numWords * 2 <= numWords) _numWords *= 2;
+		_words.reset(new std::atomic<uint64_t>[_numWords]);
+		for (size_t i = 0; i < _numWords; ++i) _words[i] = 0;
+	}
+
+	void insert(Kmer kmer)
+	{
+		const size_t hash = kmer.hash();
+		const uint64_t mask = bitMask(hash);
+		auto& word = _words[hash & (_numWords - 1)];
+		const uint64_t prev = word.fetch_or(mask, std::memory_order_relaxed);
+		if ((prev & mask) == mask)
+		{
+			word.fetch_or(mask << 32, std::memory_order_relaxed);
+		}
+	}
+
+	bool isRepeated(Kmer kmer) const
+	{
+		const size_t hash = kmer.hash();
+		const uint64_t mask = bitMask(hash) << 32;
+		return (_words[hash & (_numWords - 1)]
+					.load(std::memory_order_relaxed) & mask) == mask;
+	}
+
+	size_t memoryUsage() const {return _numWords * sizeof(uint64_t);}
+
+	//estimated fraction of the k-mers inserted once that pass the
+	//filter (all their second level bits were set by other k-mers)
+	double singletonPassRate() const
+	{
+		size_t setBits = 0;
+		for (size_t i = 0; i < _numWords; ++i)
+		{
+			setBits += __builtin_popcountll(_words[i].load(std::memory_order_relaxed) >> 32);
+		}
+		const double fill = (double)setBits / (_numWords * 32);
+		return fill * fill * fill;
+	}
+
+private:
+	//bits within the 32-bit half word, taken from the hash bits
+	//that are not used for the word index
+	static uint64_t bitMask(size_t hash)
+	{
+		return (1ULL << ((hash >> 32) & 31)) |
+			   (1ULL << ((hash >> 37) & 31)) |
+			   (1ULL << ((hash >> 42) & 31));
+	}
+
+	size_t _numWords;
+	std::unique_ptr<std::atomic<uint64_t>[]> _words;
+};
@@ -0,0 +1,138 @@
+//(c) 2020 by Authors
+//This file is a part of the Flye package.
+//Released under the BSD license (see LICENSE file)
+
+#include <iostream>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <execinfo.h>
+
+#include "../sequence/sequence_container.h"
+#include "../common/config.h"
+#include "../common/logger.h"
+#include "../common/utils.h"
+#include "../common/memory_info.h"
+
+#include <getopt.h>
+
+bool parseArgs(int argc, char** argv, std::string& readsFasta,
+			   std::string& outPacked, std::string& logFile,
+			   int& minReadLength, bool& debug, size_t& numThreads)
+{
+	auto printUsage = []()
+	{
+		std::cerr << "Usage: flye-pack "
+				  << " --reads path --out path [--min-read length]\n"
+				  << "\t\t[--log path] [--threads num] [--debug] [-h]\n\n"
+				  << "Required arguments:\n"
+				  << "  --reads path\tcomma-separated list of read files\n"
+				  << "  --out path\tpath to the output packed file\n\n"
+				  << "Optional arguments:\n"
+				  << "  --min-read length\tskip reads that are not longer "
+				  << "[default = 0] \n"
+				  << "  --debug \t\tenable debug output "
+				  << "[default = false] \n"
+				  << "  --log log_file\toutput log to file "
+				  << "[default = not set] \n"
+				  << "  --threads num_threads\tnumber of parallel threads "
+				  << "[default = 1] \n";
+	};
+
+	int optionIndex = 0;
+	static option longOptions[] =
+	{
+		{"reads", required_argument, 0, 0},
+		{"out", required_argument, 0, 0},
+		{"min-read", required_argument, 0, 0},
+		{"log", required_argument, 0, 0},
+		{"threads", required_argument, 0, 0},
+		{"debug", no_argument, 0, 0},
+		{0, 0, 0, 0}
+	};
+
+	int opt = 0;
+	while ((opt = getopt_long(argc, argv, "h", longOptions, &optionIndex)) != -1)
+	{
+		switch(opt)
+		{
+		case 0:
+			if (!strcmp(longOptions[optionIndex].name, "min-read"))
+				minReadLength = atoi(optarg);
+			else if (!strcmp(longOptions[optionIndex].name, "threads"))
+				numThreads = atoi(optarg);
+			else if (!strcmp(longOptions[optionIndex].name, "log"))
+				logFile = optarg;
+			else if (!strcmp(longOptions[optionIndex].name, "debug"))
+				debug = true;
+			else if (!strcmp(longOptions[optionIndex].name, "reads"))
+				readsFasta = optarg;
+			else if (!strcmp(longOptions[optionIndex].name, "out"))
+				outPacked = optarg;
+			break;
+
+		case 'h':
+			printUsage();
+			exit(0);
+		}
+	}
+	if (readsFasta.empty() || outPacked.empty())
+	{
+		printUsage();
+		return false;
+	}
+
+	return true;
+}
+
+//Parses the reads once and stores them in a binary file,
+//which is later memory-mapped by other modules instead of
+//parsing the original fasta/q files
+int pack_main(int argc, char** argv)
+{
+	#ifdef NDEBUG
+	signal(SIGSEGV, segfaultHandler);
+	std::set_terminate(exceptionHandler);
+	#endif
+
+	bool debugging = false;
+	int minReadLength = 0;
+	size_t numThreads = 1;
+	std::string readsFasta;
+	std::string outPacked;
+	std::string logFile;
+	if (!parseArgs(argc, argv, readsFasta, outPacked, logFile,
+				   minReadLength, debugging, numThreads)) return 1;
+
+	Logger::get().setDebugging(debugging);
+	if (!logFile.empty()) Logger::get().setOutputFile(logFile);
+	Logger::get().debug() << "Build date: " << __DATE__ << " " << __TIME__;
+	std::ios::sync_with_stdio(false);
+	Parameters::get().numThreads = numThreads;
+
+	Logger::get().info() << "Reading sequences";
+	SequenceContainer seqReads;
+	std::vector<std::string> readsList = splitString(readsFasta, ',');
+	try
+	{
+		for (auto& readsFile : readsList)
+		{
+			seqReads.loadFromFile(readsFile, minReadLength);
+		}
+	}
+	catch (SequenceContainer::ParseException& e)
+	{
+		Logger::get().error() << e.what();
+		return 1;
+	}
+
+	Logger::get().info() << "Writing packed sequences";
+	seqReads.writePacked(outPacked);
+	Logger::get().debug() << "Packed " << seqReads.iterSeqs().size() / 2
+		<< " sequences";
+
+	Logger::get().debug() << "Peak RAM usage: "
+		<< getPeakRSS() / 1024 / 1024 / 1024 << " Gb";
+
+	return 0;
+}
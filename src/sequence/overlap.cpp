@@ -98,6 +98,7 @@ namespace
 //might be used in parallel
 std::vector<OverlapRange> 
 OverlapDetector::getSeqOverlaps(const FastaRecord& fastaRec, 
+								const SequenceContainer& queryContainer,
 								bool forceLocal,
 								OvlpDivStats& divStats,
 								int maxOverlaps) const
@@ -176,27 +177,46 @@ OverlapDetector::getSeqOverlaps(const FastaRecord& fastaRec,
 						(std::chrono::system_clock::now() - timeStart).count();
 	timeStart = std::chrono::system_clock::now();
 
-	for (const auto& curKmerPos : IterKmers(fastaRec.sequence))
+	//the query k-mers are looked up in batches, so that the index
+	//memory accesses of the different k-mers overlap
+	thread_local std::vector<CanonicalKmerPosition> batchKmers;
+	thread_local std::vector<VertexIndex::IterHelper> batchPositions;
+	bool batchRepetitive[VertexIndex::QUERY_BATCH];
+	auto processBatch = [&]()
 	{
-		if (_vertexIndex.isRepetitive(curKmerPos.kmer))
+		_vertexIndex.iterKmerPosBatch(batchKmers.data(), batchKmers.size(),
+									  batchPositions, batchRepetitive);
+		for (size_t i = 0; i < batchKmers.size(); ++i)
 		{
-			curFilteredPos.push_back(curKmerPos.position);
-			continue;
-		}
-		if (!_vertexIndex.kmerFreq(curKmerPos.kmer)) continue;
+			const auto& curKmerPos = batchKmers[i];
+			if (batchRepetitive[i])
+			{
+				curFilteredPos.push_back(curKmerPos.position);
+				continue;
+			}
 
-		//FastaRecord::Id prevSeqId = FastaRecord::ID_NONE;
-		for (const auto& extReadPos : _vertexIndex.iterKmerPos(curKmerPos.kmer))
-		{
-			//no trivial matches
-			if ((extReadPos.readId == fastaRec.id &&
-				extReadPos.position == curKmerPos.position)) continue;
+			//FastaRecord::Id prevSeqId = FastaRecord::ID_NONE;
+			for (const auto& extReadPos : batchPositions[i])
+			{
+				//no trivial matches
+				if ((extReadPos.readId == fastaRec.id &&
+					extReadPos.position == curKmerPos.position)) continue;
 
-			vecMatches.emplace_back(curKmerPos.position, 
-									extReadPos.position,
-									extReadPos.readId);
+				vecMatches.emplace_back(curKmerPos.position, 
+										extReadPos.position,
+										extReadPos.readId);
+			}
 		}
+		batchKmers.clear();
+	};
+
+	batchKmers.clear();
+	for (const auto& curKmerPos : IterCanonicalKmers(fastaRec.sequence))
+	{
+		batchKmers.push_back(curKmerPos);
+		if (batchKmers.size() == VertexIndex::QUERY_BATCH) processBatch();
 	}
+	if (!batchKmers.empty()) processBatch();
 	timeKmerIndexFirst += std::chrono::duration_cast<std::chrono::duration<float>>
 							(std::chrono::system_clock::now() - timeStart).count();
 	timeStart = std::chrono::system_clock::now();
@@ -466,8 +486,8 @@ OverlapDetector::getSeqOverlaps(const FastaRecord& fastaRec,
 		{
 			if(_nuclAlignment)	//identity using base-level alignment
 			{
-				ovlp.seqDivergence = getAlignmentErrEdlib(ovlp, fastaRec.sequence, 
-														   _seqContainer.getSeq(extId),
+				ovlp.seqDivergence = getAlignmentErrEdlib(ovlp, queryContainer, 
+														   _seqContainer,
 														   _maxDivergence, _useHpc);
 			}
 
@@ -479,8 +499,7 @@ OverlapDetector::getSeqOverlaps(const FastaRecord& fastaRec,
 			else if (_partitionBadMappings)
 			{
 				auto trimmedOverlaps = 
-					checkIdyAndTrim(ovlp, fastaRec.sequence, 
-								    _seqContainer.getSeq(extId),
+					checkIdyAndTrim(ovlp, queryContainer, _seqContainer,
 								    _maxDivergence, _minOverlap, _useHpc);
 				for (auto& trimOvlp : trimmedOverlaps)
 				{
@@ -524,7 +543,7 @@ std::vector<OverlapRange>
 {
 	//bool suggestChimeric;
 	const FastaRecord& record = _queryContainer.getRecord(readId);
-	return _ovlpDetect.getSeqOverlaps(record, forceLocal, 
+	return _ovlpDetect.getSeqOverlaps(record, _queryContainer, forceLocal, 
 									  _divergenceStats, maxOverlaps);
 }
 
@@ -532,7 +551,7 @@ std::vector<OverlapRange>
 	OverlapContainer::quickSeqOverlaps(const FastaRecord& record, 
 									   int maxOverlaps, bool forceLocal)
 {
-	return _ovlpDetect.getSeqOverlaps(record, forceLocal, 
+	return _ovlpDetect.getSeqOverlaps(record, _queryContainer, forceLocal, 
 									  _divergenceStats, maxOverlaps);
 }
 
@@ -557,7 +576,8 @@ const std::vector<OverlapRange>&
 	//bool suggestChimeric;
 	const bool DEFAULT_LOCAL = false;
 	const FastaRecord& record = _queryContainer.getRecord(readId);
-	auto overlaps = _ovlpDetect.getSeqOverlaps(record, DEFAULT_LOCAL, 
+	auto overlaps = _ovlpDetect.getSeqOverlaps(record, _queryContainer, 
+											   DEFAULT_LOCAL, 
 											   _divergenceStats,
 											   _ovlpDetect._maxCurOverlaps);
 	overlaps.shrink_to_fit();
@@ -340,6 +340,7 @@ public:
 private:
 	std::vector<OverlapRange> 
 	getSeqOverlaps(const FastaRecord& fastaRec, 
+				   const SequenceContainer& queryContainer,
 				   bool forceLocal,
 				   OvlpDivStats& divergenceStats,
 				   int maxOverlaps) const;
@@ -410,6 +411,7 @@ public:
 											   int maxOverlaps=0,
 											   bool forceLocal=false);
 
+	//the record should belong to the query container
 	std::vector<OverlapRange> quickSeqOverlaps(const FastaRecord& record, 
 											   int maxOverlaps=0,
 											   bool forceLocal=false);
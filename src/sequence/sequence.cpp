@@ -1,4 +1,5 @@
 #include "sequence.h"
 
 std::vector<size_t> DnaSequence::_dnaTable;
+std::vector<uint32_t> DnaSequence::_decodeTable;
 DnaSequence::TableFiller DnaSequence::_filler;
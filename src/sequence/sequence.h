@@ -10,8 +10,13 @@
 #include <iostream>
 #include <algorithm>
 #include <stdexcept>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#include <atomic>
 
-//Immutable dna sequence class
+//Immutable dna sequence class. Substrings and reverse complements
+//are views (offset + length) into the same shared buffer
 class DnaSequence
 {
 public:
@@ -21,62 +26,82 @@ private:
 	static const int NUCL_BITS = 2;
 	static const int NUCL_IN_CHUNK = sizeof(NuclType) * 8 / NUCL_BITS;
 
+	//chunks are either owned by the buffer or point into an external
+	//storage (e.g. memory-mapped file), which is kept alive by "owner".
+	//The reference counter is atomic, so sequences could be copied 
+	//and destroyed concurrently from different threads
 	struct SharedBuffer
 	{
-		SharedBuffer(): useCount(0), length(0) {}
-		size_t useCount;
+		SharedBuffer(): useCount(0), length(0), data(nullptr) {}
+		std::atomic<size_t> useCount;
 		size_t length;
-		std::vector<size_t> chunks;
+		const NuclType* data;
+		std::vector<NuclType> chunks;
+		std::shared_ptr<const void> owner;
 	};
 
 public:
 	DnaSequence():
-		_complement(false)
+		_offset(0), _length(0), _complement(false)
 	{
 		_data = new SharedBuffer;
-		++_data->useCount;
+		acquireBuffer(_data);
 	}
 
 	~DnaSequence()
 	{
-		if (_data != nullptr)
-		{
-			//std::cout << "Destructor!\n";
-			--_data->useCount;
-			if (_data->useCount == 0) 
-			{
-				//std::cout << "Deleting\n";
-				delete _data;
-			}
-		}
+		releaseBuffer(_data);
 	}
 
 	explicit DnaSequence(const std::string& string):
-		_complement(false)
+		DnaSequence(string.data(), string.length())
+	{}
+
+	DnaSequence(const char* string, size_t length):
+		_offset(0), _length(length), _complement(false)
 	{
 		_data = new SharedBuffer;
-		++_data->useCount;
+		acquireBuffer(_data);
 
-		if (string.empty()) return;
+		if (length == 0) return;
 
-		_data->length = string.length();
-		_data->chunks.assign((_data->length - 1) / NUCL_IN_CHUNK + 1, 0);
-		for (size_t i = 0; i < string.length(); ++i)
+		_data->length = length;
+		_data->chunks.assign(numChunks(_data->length), 0);
+		for (size_t i = 0; i < length; ++i)
 		{
 			size_t chunkId = i / NUCL_IN_CHUNK;
 			_data->chunks[chunkId] |= dnaToId(string[i]) << (i % NUCL_IN_CHUNK) * 2;
 		}
+		_data->data = _data->chunks.data();
+	}
+
+	//wraps 2-bit packed chunks stored outside of the sequence 
+	//(no copy is made). The chunks should remain valid while
+	//the owner is alive
+	static DnaSequence fromChunks(const NuclType* chunks, size_t length,
+								  std::shared_ptr<const void> owner)
+	{
+		DnaSequence newSequence;
+		newSequence._data->length = length;
+		newSequence._data->data = chunks;
+		newSequence._length = length;
+		newSequence._data->owner = std::move(owner);
+		return newSequence;
 	}
 
 	DnaSequence(const DnaSequence& other):
 		_data(other._data),
+		_offset(other._offset),
+		_length(other._length),
 		_complement(other._complement)
 	{
-		++_data->useCount;
+		acquireBuffer(_data);
 	}
 
 	DnaSequence(DnaSequence&& other):
 		_data(other._data),
+		_offset(other._offset),
+		_length(other._length),
 		_complement(other._complement)
 	{
 		other._data = nullptr;
@@ -86,12 +111,13 @@ public:
 	{
 		if (this == &other) return *this;
 
-		--_data->useCount;
-		if (_data->useCount == 0) delete _data;
+		acquireBuffer(other._data);
+		releaseBuffer(_data);
 
 		_complement = other._complement;
+		_offset = other._offset;
+		_length = other._length;
 		_data = other._data;
-		++_data->useCount;
 		return *this;
 	}
 
@@ -99,24 +125,26 @@ public:
 	{
 		if (this == &other) return *this;
 
-		--_data->useCount;
-		if (_data->useCount == 0) delete _data;
+		releaseBuffer(_data);
 
 		_data = other._data;
+		_offset = other._offset;
+		_length = other._length;
 		_complement = other._complement;
 		other._data = nullptr;
 		return *this;
 	}
 
-	size_t length() const {return _data->length;}
+	size_t length() const {return _length;}
 
 	char at(size_t index) const 
 	{
 		if (_complement)
 		{
-			index = _data->length - index - 1;
+			index = _length - index - 1;
 		}
-		size_t id = (_data->chunks[index / NUCL_IN_CHUNK] >> 
+		index += _offset;
+		size_t id = (_data->data[index / NUCL_IN_CHUNK] >> 
 					 (index % NUCL_IN_CHUNK) * 2 ) & 3;
 		return idToDna(!_complement ? id : ~id & 3);
 	}
@@ -125,15 +153,14 @@ public:
 	{
 		if (_complement)
 		{
-			index = _data->length - index - 1;
+			index = _length - index - 1;
 		}
-		size_t id = (_data->chunks[index / NUCL_IN_CHUNK] >> 
+		index += _offset;
+		size_t id = (_data->data[index / NUCL_IN_CHUNK] >> 
 					 (index % NUCL_IN_CHUNK) * 2 ) & 3;
 		return !_complement ? id : ~id & 3;
 	}
-	
-	//TODO: use the same shared buffer
-	
+
 	DnaSequence complement() const
 	{
 		DnaSequence complSequence(*this);
@@ -141,8 +168,33 @@ public:
 		return complSequence;
 	}
 
+	//returns a view that shares the buffer with this sequence
 	DnaSequence substr(size_t start, size_t length) const;
-	std::string str() const;	
+
+	std::string str() const {return this->str(0, _length);}
+
+	//decodes the substring without creating a new sequence view
+	std::string str(size_t start, size_t length) const;
+
+	//2-bit packed copy of the sequence (as it reads on its strand)
+	std::vector<NuclType> packedChunks() const
+	{
+		std::vector<NuclType> chunks(numChunks(_length), 0);
+		if (_length > 0) this->extractChunks(0, _length, chunks.data());
+		return chunks;
+	}
+
+	//same as above, but reuses the provided buffer
+	void packedChunks(std::vector<NuclType>& chunks) const
+	{
+		chunks.assign(numChunks(_length), 0);
+		if (_length > 0) this->extractChunks(0, _length, chunks.data());
+	}
+
+	static size_t numChunks(size_t length)
+	{
+		return length > 0 ? (length - 1) / NUCL_IN_CHUNK + 1 : 0;
+	}
 
 	static size_t dnaToId(char c)
 	{
@@ -155,8 +207,32 @@ public:
 		return table[id];
 	}
 
+	//reverses the order of 2-bit nucleotides within the word 
+	//and complements them
+	static NuclType reverseComplementChunk(NuclType chunk);
+
 private:
+	static void acquireBuffer(SharedBuffer* buffer)
+	{
+		buffer->useCount.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	static void releaseBuffer(SharedBuffer* buffer)
+	{
+		if (buffer == nullptr) return;	//moved-from sequence
+		if (buffer->useCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		{
+			delete buffer;
+		}
+	}
+
+	//word-level helpers for 2-bit packed chunks
+	static void copyChunks(const NuclType* src, size_t srcLength, 
+						   size_t start, size_t length, NuclType* dst);
+	void extractChunks(size_t start, size_t length, NuclType* dst) const;
+
 	static std::vector<size_t> _dnaTable;
+	static std::vector<uint32_t> _decodeTable;	//4 nucleotides per byte
 
 	struct TableFiller
 	{
@@ -175,46 +251,144 @@ private:
 				_dnaTable[(size_t)'g'] = 2;
 				_dnaTable[(size_t)'T'] = 3;
 				_dnaTable[(size_t)'t'] = 3;
+
+				_decodeTable.assign(256, 0);
+				for (size_t byte = 0; byte < 256; ++byte)
+				{
+					char decoded[4];
+					for (size_t i = 0; i < 4; ++i)
+					{
+						decoded[i] = idToDna((byte >> (i * 2)) & 3);
+					}
+					memcpy(&_decodeTable[byte], decoded, 4);
+				}
 			}
 		}
 	};
 	static TableFiller _filler;
 
 	SharedBuffer* _data;
+	size_t _offset;		//view position on the forward strand of the buffer
+	size_t _length;
 	bool _complement;
 };
 
-inline std::string DnaSequence::str() const 
+//copies "length" nucleotides starting from "start" into 
+//the (zero-initialized) destination, one 64-bit word at a time
+inline void DnaSequence::copyChunks(const NuclType* src, size_t srcLength,
+									size_t start, size_t length, 
+									NuclType* dst)
+{
+	const size_t srcChunks = numChunks(srcLength);
+	const size_t dstChunks = numChunks(length);
+	const size_t firstChunk = start / NUCL_IN_CHUNK;
+	const size_t shift = (start % NUCL_IN_CHUNK) * NUCL_BITS;
+	for (size_t i = 0; i < dstChunks; ++i)
+	{
+		NuclType chunk = src[firstChunk + i] >> shift;
+		if (shift > 0 && firstChunk + i + 1 < srcChunks)
+		{
+			chunk |= src[firstChunk + i + 1] << (sizeof(NuclType) * 8 - shift);
+		}
+		dst[i] = chunk;
+	}
+	const size_t tail = length % NUCL_IN_CHUNK;
+	if (tail > 0)
+	{
+		dst[dstChunks - 1] &= ((NuclType)1 << tail * NUCL_BITS) - 1;
+	}
+}
+
+inline DnaSequence::NuclType DnaSequence::reverseComplementChunk(NuclType chunk)
 {
-	std::string result;
-	result.reserve(this->length());
-	for (size_t i = 0; i < this->length(); ++i)
+	chunk = __builtin_bswap64(chunk);
+	chunk = ((chunk >> 4) & 0x0F0F0F0F0F0F0F0FULL) | 
+			((chunk & 0x0F0F0F0F0F0F0F0FULL) << 4);
+	chunk = ((chunk >> 2) & 0x3333333333333333ULL) | 
+			((chunk & 0x3333333333333333ULL) << 2);
+	return ~chunk;
+}
+
+//packs the nucleotides [start, start + length) of this sequence 
+//(taking the strand into account) into the destination
+inline void DnaSequence::extractChunks(size_t start, size_t length, 
+									   NuclType* dst) const
+{
+	if (!_complement)
 	{
-		result.push_back(this->at(i));
+		copyChunks(_data->data, _data->length, _offset + start, length, dst);
+		return;
+	}
+
+	//take the corresponding forward strand range, reverse-complement
+	//each word and reverse the word order. The result is padded 
+	//from the left, so shift it to the beginning. Everything is done
+	//in place: the shift reads each word before overwriting it
+	const size_t fwdStart = _offset + _length - start - length;
+	const size_t numWords = numChunks(length);
+	copyChunks(_data->data, _data->length, fwdStart, length, dst);
+	std::reverse(dst, dst + numWords);
+	for (size_t i = 0; i < numWords; ++i) 
+	{
+		dst[i] = reverseComplementChunk(dst[i]);
+	}
+
+	const size_t padding = numWords * NUCL_IN_CHUNK - length;
+	if (padding > 0)
+	{
+		copyChunks(dst, numWords * NUCL_IN_CHUNK, padding, length, dst);
 	}
-	return result;
 }
 
-inline DnaSequence DnaSequence::substr(size_t start, size_t length) const 
+inline std::string DnaSequence::str(size_t start, size_t length) const 
 {
-	if (length == 0) throw std::runtime_error("Zero length subtring");
-	if (start >= _data->length) throw std::runtime_error("Incorrect substring start");
+	if (start + length > _length) 
+	{
+		throw std::runtime_error("Incorrect substring range");
+	}
+	if (length == 0) return std::string();
+
+	//word-aligned forward strand could be decoded in place
+	const size_t numWords = numChunks(length);
+	const NuclType* chunks = _data->data + (_offset + start) / NUCL_IN_CHUNK;
+	thread_local std::vector<NuclType> buffer;
+	if (_complement || (_offset + start) % NUCL_IN_CHUNK != 0)
+	{
+		buffer.assign(numWords, 0);
+		this->extractChunks(start, length, buffer.data());
+		chunks = buffer.data();
+	}
 
-	if (start + length > _data->length)
+	//decoding 4 nucleotides (one byte) at a time
+	std::string result(numWords * NUCL_IN_CHUNK, 'A');
+	char* out = &result[0];
+	for (size_t i = 0; i < numWords; ++i)
 	{
-		length = _data->length - start;
+		NuclType chunk = chunks[i];
+		for (size_t byte = 0; byte < sizeof(NuclType); ++byte)
+		{
+			memcpy(out, &_decodeTable[chunk & 0xFF], 4);
+			chunk >>= 8;
+			out += 4;
+		}
 	}
+	result.resize(length);
+	return result;
+}
 
-	DnaSequence newSequence;
-	newSequence._data->length = length;
-	newSequence._data->chunks.assign((length - 1) / NUCL_IN_CHUNK + 1, 0);
+inline DnaSequence DnaSequence::substr(size_t start, size_t length) const 
+{
+	if (length == 0) throw std::runtime_error("Zero length subtring");
+	if (start >= _length) throw std::runtime_error("Incorrect substring start");
 
-	for (size_t i = 0; i < length; ++i)
+	if (start + length > _length)
 	{
-		size_t nucId = this->atRaw(start + i);
-		size_t newChunkId = i / NUCL_IN_CHUNK;
-		newSequence._data->chunks[newChunkId] |= nucId << (i % NUCL_IN_CHUNK) * 2;
+		length = _length - start;
 	}
 
+	DnaSequence newSequence(*this);
+	newSequence._length = length;
+	newSequence._offset = !_complement ? _offset + start : 
+						  _offset + _length - start - length;
 	return newSequence;
 }
@@ -7,17 +7,62 @@
 #include <sstream>
 #include <iostream>
 #include <random>
+#include <cmath>
 #include <algorithm>
+#include <cstring>
+#include <thread>
+#include <exception>
 #include <zlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "sequence_container.h"
 #include "../common/logger.h"
+#include "../common/config.h"
+#include "../common/parallel.h"
 
 size_t SequenceContainer::g_nextSeqId = 0;
 
 const FastaRecord::Id FastaRecord::ID_NONE = 
 			Id(std::numeric_limits<uint32_t>::max());
 
+namespace
+{
+	//Packed file layout: header, table of sequences, 
+	//concatenated names, then 8-byte aligned 2-bit chunks.
+	//All offsets are in bytes from the beginning of the file,
+	//except for the chunk offsets, which are in chunks
+	const char PACKED_MAGIC[8] = {'F', 'L', 'Y', 'E', 'P', 'A', 'C', 'K'};
+	const uint32_t PACKED_VERSION = 1;
+
+	struct PackedHeader
+	{
+		char 	 magic[8];
+		uint32_t version;
+		uint32_t chunkSize;
+		uint64_t numSequences;
+		uint64_t tableOffset;
+		uint64_t namesOffset;
+		uint64_t chunksOffset;
+		uint64_t fileSize;
+	};
+
+	struct PackedEntry
+	{
+		uint64_t chunkOffset;
+		uint64_t length;
+		uint64_t nameOffset;
+		uint64_t nameLength;
+	};
+
+	uint64_t alignUp(uint64_t value)
+	{
+		return (value + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t);
+	}
+}
+
 
 bool SequenceContainer::isFasta(const std::string& fileName)
 {
@@ -53,56 +98,574 @@ FastaRecord::Id SequenceContainer::addSequence(const FastaRecord& seqRec)
 		_seqIdOffest = g_nextSeqId;
 	}
 	FastaRecord::Id newId(g_nextSeqId);
-	if (_seqIndex.size() != g_nextSeqId - _seqIdOffest) 
+	if (_sequences.size() != g_nextSeqId - _seqIdOffest) 
 	{
 		throw std::runtime_error("something wrong with sequence ids!");
 	}
-	g_nextSeqId += 2;
-
-	_seqIndex.emplace_back(seqRec.sequence, "+" + seqRec.description, 
-						   newId);
-
-	if (_nameIndex.count(_seqIndex.back().description))
+	if (_nameIndex.count(seqRec.description))
 	{
 		throw ParseException("The input contain reads with duplicated IDs. "
 							 "Make sure all reads have unique IDs and restart. "
 							 "The first problematic ID was: " +
-			 				 _seqIndex.back().description.substr(1));
+			 				 seqRec.description);
+	}
+	g_nextSeqId += 2;
+
+	//reverse complement shares the buffer, only the handle is stored
+	_sequences.push_back(seqRec.sequence);
+	_sequences.push_back(seqRec.sequence.complement());
+	_names.push_back(seqRec.description);
+	_nameIndex[seqRec.description] = newId;
+
+	return newId;
+}
+
+namespace
+{
+	//Reads (decompressed) text from fasta/q file in large blocks.
+	//Plain text and gzip (including multi-member) files are read 
+	//through zlib, BGZF blocks are decompressed in parallel
+	class TextReader
+	{
+	public:
+		TextReader(const std::string& fileName, size_t numThreads);
+		~TextReader();
+		TextReader(const TextReader&) = delete;
+		void operator=(const TextReader&) = delete;
+
+		bool read(std::vector<char>& buffer);
+		//BGZF blocks are decompressed with all threads, so such 
+		//reads should not overlap with the (parallel) parsing
+		bool parallelRead() const {return _bgzf;}
+
+	private:
+		static const size_t READ_BLOCK = 32 * 1024 * 1024;
+		static const size_t BGZF_HEADER = 18;
+
+		bool readBgzf(std::vector<char>& buffer);
+		static size_t bgzfBlockSize(const uint8_t* header, size_t available);
+
+		FILE*  _rawFile;
+		gzFile _gzFile;
+		bool   _bgzf;
+		size_t _numThreads;
+		std::vector<char> _rawBuffer;
+	};
+
+	struct TextChunk
+	{
+		size_t begin;
+		size_t end;
+		size_t firstLine;
+	};
+
+	//the position (and line), up to which the text was scanned 
+	//without finding a complete record. After more text is read,
+	//the scan resumes from there, so a long record is scanned once
+	struct ScanState
+	{
+		ScanState(): offset(0), lines(0) {}
+		size_t offset;
+		size_t lines;
+	};
+
+	//Returns the next line and advances the position. The line
+	//is returned without the trailing newline and carriage return
+	inline void nextLine(char*& pos, char* end, char*& lineBegin, 
+						 char*& lineEnd)
+	{
+		lineBegin = pos;
+		char* newLine = (char*)memchr(pos, '\n', end - pos);
+		lineEnd = newLine ? newLine : end;
+		pos = newLine ? newLine + 1 : end;
+		if (lineEnd != lineBegin && *(lineEnd - 1) == '\r') --lineEnd;
+	}
+
+	//A base passes if the mean (Phred+33) quality of the surrounding
+	//window is at least minQuality. By default, only the failing ends
+	//are trimmed, and the segment between the first and the last passing
+	//base is returned. Otherwise, the longest segment of passing bases
+	//is returned. The window sum is updated incrementally as it slides 
+	//along the read
+	void qualityTrim(const char* quality, size_t length, int minQuality,
+					 size_t windowSize, bool longestSegment, 
+					 size_t& outStart, size_t& outLength)
+	{
+		const size_t halfWindow = windowSize / 2;
+		int64_t windowSum = 0;
+		size_t windowBegin = 0;
+		size_t windowEnd = 0;
+		size_t segmentStart = 0;
+		outStart = 0;
+		outLength = 0;
+		for (size_t i = 0; i < length; ++i)
+		{
+			const size_t newBegin = i > halfWindow ? i - halfWindow : 0;
+			const size_t newEnd = std::min(i + halfWindow + 1, length);
+			for (; windowEnd < newEnd; ++windowEnd) 
+			{
+				windowSum += std::max(quality[windowEnd] - 33, 0);
+			}
+			for (; windowBegin < newBegin; ++windowBegin) 
+			{
+				windowSum -= std::max(quality[windowBegin] - 33, 0);
+			}
+
+			if (windowSum < (int64_t)minQuality * 
+							(int64_t)(windowEnd - windowBegin))
+			{
+				//inner failing bases are kept when trimming the ends only
+				if (longestSegment || outLength == 0) segmentStart = i + 1;
+			}
+			else if (i + 1 - segmentStart > outLength)
+			{
+				outStart = segmentStart;
+				outLength = i + 1 - segmentStart;
+			}
+		}
+	}
+
+	TextReader::TextReader(const std::string& fileName, size_t numThreads):
+		_rawFile(nullptr), _gzFile(nullptr), _bgzf(false), 
+		_numThreads(numThreads)
+	{
+		//BGZF is a series of independent gzip members, each 
+		//containing 'BC' extra field with the member size
+		_rawFile = fopen(fileName.c_str(), "rb");
+		if (!_rawFile) throw SequenceContainer::ParseException("Can't open reads file");
+
+		uint8_t header[BGZF_HEADER];
+		if (fread(header, 1, BGZF_HEADER, _rawFile) == BGZF_HEADER &&
+			header[0] == 31 && header[1] == 139 && header[2] == 8 && 
+			(header[3] & 4) && bgzfBlockSize(header, BGZF_HEADER) > 0)
+		{
+			_bgzf = true;
+			rewind(_rawFile);
+			return;
+		}
+		fclose(_rawFile);
+		_rawFile = nullptr;
+
+		//plain text or generic gzip (including multi-member)
+		_gzFile = gzopen(fileName.c_str(), "rb");
+		if (!_gzFile) throw SequenceContainer::ParseException("Can't open reads file");
+		gzbuffer(_gzFile, 1024 * 1024);
+	}
+
+	TextReader::~TextReader()
+	{
+		if (_rawFile) fclose(_rawFile);
+		if (_gzFile) gzclose(_gzFile);
+	}
+
+	//returns the total size of the BGZF block, or 0 if this is not a BGZF header
+	size_t TextReader::bgzfBlockSize(const uint8_t* header, size_t available)
+	{
+		if (available < BGZF_HEADER) return 0;
+		const size_t extraLen = header[10] + (header[11] << 8);
+		if (available < 12 + extraLen) return 0;
+
+		size_t pos = 12;
+		while (pos + 4 <= 12 + extraLen)
+		{
+			const size_t fieldLen = header[pos + 2] + (header[pos + 3] << 8);
+			if (header[pos] == 'B' && header[pos + 1] == 'C' && fieldLen == 2)
+			{
+				return header[pos + 4] + (header[pos + 5] << 8) + 1;
+			}
+			pos += 4 + fieldLen;
+		}
+		return 0;
+	}
+
+	bool TextReader::read(std::vector<char>& buffer)
+	{
+		if (_bgzf) return this->readBgzf(buffer);
+
+		const size_t prevSize = buffer.size();
+		buffer.resize(prevSize + READ_BLOCK);
+		int bytesRead = gzread(_gzFile, buffer.data() + prevSize, READ_BLOCK);
+		if (bytesRead < 0)
+		{
+			int errNum = 0;
+			throw SequenceContainer::ParseException(std::string("Error reading file: ") + 
+								 gzerror(_gzFile, &errNum));
+		}
+		buffer.resize(prevSize + bytesRead);
+		return bytesRead > 0;
+	}
+
+	bool TextReader::readBgzf(std::vector<char>& buffer)
+	{
+		//BGZF blocks decompress into at most 64Kb, so reading
+		//a quarter of the text block is usually enough
+		const size_t prevRaw = _rawBuffer.size();
+		_rawBuffer.resize(prevRaw + READ_BLOCK / 4);
+		size_t bytesRead = fread(_rawBuffer.data() + prevRaw, 1, 
+								 READ_BLOCK / 4, _rawFile);
+		_rawBuffer.resize(prevRaw + bytesRead);
+		if (_rawBuffer.empty()) return false;
+
+		struct Block
+		{
+			size_t rawOffset;
+			size_t rawSize;
+			size_t textOffset;
+			size_t textSize;
+		};
+		std::vector<Block> blocks;
+		size_t rawPos = 0;
+		size_t textPos = buffer.size();
+		while (rawPos < _rawBuffer.size())
+		{
+			const uint8_t* header = (const uint8_t*)_rawBuffer.data() + rawPos;
+			const size_t available = _rawBuffer.size() - rawPos;
+			size_t blockSize = bgzfBlockSize(header, available);
+			if (blockSize == 0 || blockSize > available) break;
+
+			const uint8_t* tail = header + blockSize - 4;
+			size_t textSize = tail[0] + (tail[1] << 8) + (tail[2] << 16) + 
+							  ((size_t)tail[3] << 24);
+			blocks.push_back({rawPos, blockSize, textPos, textSize});
+			rawPos += blockSize;
+			textPos += textSize;
+		}
+		if (blocks.empty() && bytesRead == 0)
+		{
+			throw SequenceContainer::ParseException("Truncated BGZF block");
+		}
+
+		buffer.resize(textPos);
+		std::atomic<bool> inflateFailed(false);
+		std::vector<size_t> blockIds;
+		for (size_t i = 0; i < blocks.size(); ++i) blockIds.push_back(i);
+		std::function<void(const size_t&)> inflateBlock = 
+		[this, &blocks, &buffer, &inflateFailed] (const size_t& blockId)
+		{
+			const Block& block = blocks[blockId];
+			//empty member (such as the BGZF end-of-file marker)
+			if (block.textSize == 0) return;
+			const uint8_t* header = (const uint8_t*)_rawBuffer.data() + 
+									block.rawOffset;
+			const size_t dataOffset = 12 + header[10] + (header[11] << 8);
+
+			z_stream stream;
+			memset(&stream, 0, sizeof(stream));
+			if (inflateInit2(&stream, -MAX_WBITS) != Z_OK)
+			{
+				inflateFailed = true;
+				return;
+			}
+			stream.next_in = (Bytef*)header + dataOffset;
+			stream.avail_in = block.rawSize - dataOffset - 8;
+			stream.next_out = (Bytef*)buffer.data() + block.textOffset;
+			stream.avail_out = block.textSize;
+			int status = inflate(&stream, Z_FINISH);
+			if (status != Z_STREAM_END || stream.avail_out != 0) 
+			{
+				inflateFailed = true;
+			}
+			inflateEnd(&stream);
+		};
+		processInParallel(blockIds, inflateBlock, _numThreads, false);
+		if (inflateFailed) throw SequenceContainer::ParseException("Error decompressing BGZF block");
+
+		_rawBuffer.erase(_rawBuffer.begin(), _rawBuffer.begin() + rawPos);
+		return true;
 	}
-	_nameIndex[_seqIndex.back().description] = _seqIndex.back().id;
 
-	_seqIndex.emplace_back(seqRec.sequence.complement(), 
-						   "-" + seqRec.description, newId.rc());
-	_nameIndex[_seqIndex.back().description] = _seqIndex.back().id;
+	//Splits the text into chunks that contain whole records. 
+	//Unless it is the end of file, the last (possibly incomplete)
+	//record is not included. Returns the length of the processed text
+	//and the line number, at which the rest of the text starts
+	std::vector<TextChunk> splitRecords(const std::vector<char>& text, bool eof,
+									 bool fasta, size_t numChunks, 
+									 size_t& consumed, size_t& lineNo,
+									 ScanState& scan)
+	{
+		struct RecordStart
+		{
+			size_t offset;
+			size_t line;
+		};
+		std::vector<RecordStart> starts;
+
+		const char* begin = text.data();
+		const char* end = text.data() + text.size();
+		const char* pos = begin + scan.offset;
+		const size_t firstLine = lineNo;
+		size_t numLines = scan.lines;
+		//the scanned part contains at most one record start, at the beginning
+		if (scan.offset > 0 && (!fasta || text.front() == '>'))
+		{
+			starts.push_back({0, firstLine});
+		}
+		while (pos < end)
+		{
+			if (fasta ? *pos == '>' : numLines % 4 == 0)
+			{
+				starts.push_back({(size_t)(pos - begin), firstLine + numLines});
+			}
+			const char* newLine = (const char*)memchr(pos, '\n', end - pos);
+			if (!newLine) break;
+			pos = newLine + 1;
+			++numLines;
+		}
 
-	return _seqIndex.back().id.rc();
+		consumed = text.size();
+		lineNo = firstLine + numLines;
+		if (!eof && fasta)
+		{
+			consumed = 0;
+			if (!starts.empty())
+			{
+				consumed = starts.back().offset;
+				lineNo = starts.back().line;
+				starts.pop_back();
+			}
+		}
+		else if (!eof)
+		{
+			const size_t numComplete = numLines / 4;
+			if (starts.size() > numComplete)
+			{
+				consumed = starts[numComplete].offset;
+				lineNo = starts[numComplete].line;
+				starts.resize(numComplete);
+			}
+		}
+		if (consumed == 0) 
+		{
+			scan.offset = pos - begin;
+			scan.lines = numLines;
+			return {};
+		}
+		scan = ScanState();
+
+		//if there is something before the first record, 
+		//the parser will report an error
+		if (starts.empty() || starts.front().offset != 0)
+		{
+			starts.insert(starts.begin(), {0, firstLine});
+		}
+
+		std::vector<TextChunk> chunks;
+		const size_t chunkLength = consumed / numChunks + 1;
+		for (const auto& start : starts)
+		{
+			if (chunks.empty() || start.offset - chunks.back().begin >= chunkLength)
+			{
+				if (!chunks.empty()) chunks.back().end = start.offset;
+				chunks.push_back({start.offset, consumed, start.line});
+			}
+		}
+		return chunks;
+	}
 }
 
 void SequenceContainer::loadFromFile(const std::string& fileName, 
 									 int minReadLength)
 {
-	std::vector<FastaRecord> records;
-	if (this->isFasta(fileName))
+	this->readFile(fileName, minReadLength, 
+				   [this](FastaRecord& record) {this->addSequence(record);});
+}
+
+void SequenceContainer::loadFromFiles(const std::vector<std::string>& fileNames,
+									  int minReadLength, size_t maxTotalLength)
+{
+	if (maxTotalLength == 0)
 	{
-		this->readFasta(records, fileName);
+		for (const auto& fileName : fileNames)
+		{
+			this->loadFromFile(fileName, minReadLength);
+		}
+		return;
 	}
-	else
+
+	//Weighted reservoir sampling (Efraimidis-Spirakis): each read gets
+	//a key u^(1/length), and the reads with the largest keys are kept.
+	//Once the total length is over the budget, the read with the smallest
+	//key is dropped, so the memory is bounded by the budget
+	struct SampledRead
+	{
+		double key;
+		size_t order;
+		FastaRecord record;
+	};
+	auto keyGreater = [](const SampledRead& r1, const SampledRead& r2)
+		{return r1.key > r2.key;};
+	std::vector<SampledRead> reservoir;		//min-heap by key
+	const size_t SAMPLING_SEED = 42;	//fixed, so the runs are reproducible
+	std::mt19937 randGen(SAMPLING_SEED);
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+	size_t numReads = 0;
+	size_t totalLength = 0;
+	size_t sampledLength = 0;
+	auto sampleRead = [&](FastaRecord& record)
 	{
-		this->readFastq(records, fileName);
+		const size_t length = record.sequence.length();
+		const double key = std::log(uniform(randGen) + 
+									std::numeric_limits<double>::min()) / length;
+		++numReads;
+		totalLength += length;
+		if (sampledLength + length > maxTotalLength && !reservoir.empty() &&
+			key < reservoir.front().key) return;
+
+		reservoir.push_back({key, numReads, std::move(record)});
+		std::push_heap(reservoir.begin(), reservoir.end(), keyGreater);
+		sampledLength += length;
+		while (sampledLength > maxTotalLength)
+		{
+			std::pop_heap(reservoir.begin(), reservoir.end(), keyGreater);
+			sampledLength -= reservoir.back().record.sequence.length();
+			reservoir.pop_back();
+		}
+	};
+	for (const auto& fileName : fileNames)
+	{
+		this->readFile(fileName, minReadLength, sampleRead);
 	}
-	
-	//shuffling input reads
-	//std::vector<size_t> indicesPerm(records.size());
-	//for (size_t i = 0; i < indicesPerm.size(); ++i) indicesPerm[i] = i;
-	//std::random_shuffle(indicesPerm.begin(), indicesPerm.end());
 
-	//for (size_t i : indicesPerm)
-	for (size_t i = 0; i < records.size(); ++i)
+	//reads are added in the input order
+	std::sort(reservoir.begin(), reservoir.end(),
+			  [](const SampledRead& r1, const SampledRead& r2)
+			  {return r1.order < r2.order;});
+	for (auto& read : reservoir) this->addSequence(read.record);
+
+	Logger::get().debug() << "Sampled " << reservoir.size() << " reads ("
+		<< sampledLength << " bp) out of " << numReads << " (" 
+		<< totalLength << " bp)";
+}
+
+void SequenceContainer::readFile(const std::string& fileName, int minReadLength,
+								 const std::function<void(FastaRecord&)>& onRecord)
+{
+	if (isPacked(fileName))
 	{
-		if (records[i].sequence.length() > (size_t)minReadLength)
+		this->readPacked(fileName, minReadLength, onRecord);
+		return;
+	}
+
+	//The input is processed in blocks: while the current block is parsed
+	//(in parallel) and packed into the container, the next one is 
+	//read (and decompressed) by a separate thread
+	const bool fasta = this->isFasta(fileName);
+	const size_t numThreads = std::max(Parameters::get().numThreads, 
+									   (size_t)1);
+	TextReader reader(fileName, numThreads);
+
+	std::vector<char> text;
+	bool eof = !reader.read(text);
+	size_t lineNo = 1;
+	ScanState scan;
+	size_t numRecords = 0;
+	size_t totalBases = 0;
+	size_t trimmedBases = 0;
+	while (true)
+	{
+		size_t consumed = 0;
+		size_t nextLineNo = lineNo;
+		auto chunks = splitRecords(text, eof, fasta, numThreads * 4, 
+								   consumed, nextLineNo, scan);
+		if (consumed == 0 && !eof)
 		{
-			this->addSequence(records[i]);
+			eof = !reader.read(text);
+			continue;
 		}
+
+		std::vector<char> nextText(text.begin() + consumed, text.end());
+		bool nextEof = eof;
+		std::exception_ptr readError;
+		auto readNext = [&reader, &nextText, &nextEof, &readError]()
+		{
+			try
+			{
+				nextEof = !reader.read(nextText);
+			}
+			catch (...)
+			{
+				readError = std::current_exception();
+			}
+		};
+		//parallel (BGZF) reading is done after parsing, so that
+		//the number of working threads does not exceed the limit
+		std::thread prefetch;
+		if (!eof && !reader.parallelRead()) prefetch = std::thread(readNext);
+
+		std::vector<std::vector<FastaRecord>> parsed(chunks.size());
+		std::vector<std::string> errors(chunks.size());
+		std::vector<size_t> chunkTrimmed(chunks.size(), 0);
+		std::vector<size_t> chunkIds;
+		for (size_t i = 0; i < chunks.size(); ++i) chunkIds.push_back(i);
+		std::function<void(const size_t&)> parseChunk = 
+		[this, &text, &chunks, &parsed, &errors, &chunkTrimmed, fasta] 
+		(const size_t& chunkId)
+		{
+			const TextChunk& chunk = chunks[chunkId];
+			size_t lineNo = chunk.firstLine;
+			try
+			{
+				if (fasta)
+				{
+					this->parseFasta(text.data() + chunk.begin, 
+									 text.data() + chunk.end, lineNo,
+									 parsed[chunkId]);
+				}
+				else
+				{
+					this->parseFastq(text.data() + chunk.begin, 
+									 text.data() + chunk.end, lineNo,
+									 parsed[chunkId], chunkTrimmed[chunkId]);
+				}
+			}
+			catch (ParseException& e)
+			{
+				errors[chunkId] = "on line " + std::to_string(lineNo) + 
+								  ": " + e.what();
+			}
+		};
+		processInParallel(chunkIds, parseChunk, numThreads, false);
+		if (prefetch.joinable()) prefetch.join();
+		else if (!eof) readNext();
+
+		for (size_t i = 0; i < chunks.size(); ++i)
+		{
+			if (!errors[i].empty())
+			{
+				throw ParseException("parse error in " + fileName + 
+									 " " + errors[i]);
+			}
+			trimmedBases += chunkTrimmed[i];
+			for (auto& record : parsed[i])
+			{
+				++numRecords;
+				totalBases += record.sequence.length();
+				if (record.sequence.length() > (size_t)minReadLength)
+				{
+					onRecord(record);
+				}
+			}
+			parsed[i].clear();
+		}
+		if (readError) std::rethrow_exception(readError);
+
+		if (eof) break;
+		lineNo = nextLineNo;
+		text.swap(nextText);
+		eof = nextEof;
+	}
+
+	if (fasta && numRecords == 0)
+	{
+		throw ParseException("parse error in " + fileName + ": empty sequence");
+	}
+	if (!fasta && _trimMinQuality > 0)
+	{
+		totalBases += trimmedBases;
+		Logger::get().info() << "Quality trimming removed " << trimmedBases
+			<< " bases out of " << totalBases << " (" << 100 * trimmedBases / 
+			std::max(totalBases, (size_t)1) << "%) in " << fileName;
 	}
 }
 
@@ -110,10 +673,10 @@ int SequenceContainer::computeNxStat(float fraction) const
 {
 	std::vector<int32_t> readLengths;
 	int64_t totalLengh = 0;
-	for (const auto& read : _seqIndex) 
+	for (const auto& seq : _sequences) 
 	{
-		readLengths.push_back(read.sequence.length());
-		totalLengh += read.sequence.length();
+		readLengths.push_back(seq.length());
+		totalLengh += seq.length();
 	}
 	std::sort(readLengths.begin(), readLengths.end(),
 			  [](int32_t a, int32_t b) {return a > b;});
@@ -133,198 +696,154 @@ int SequenceContainer::computeNxStat(float fraction) const
 }
 
 //adds sequence ad it's complement
-const FastaRecord& 
-	SequenceContainer::addSequence(const DnaSequence& sequence, 
-								   const std::string& description)
+FastaRecord SequenceContainer::addSequence(const DnaSequence& sequence, 
+										   const std::string& description)
 {
 	auto newId = this->addSequence({sequence, description, 
 								   FastaRecord::ID_NONE});
-	return _seqIndex[newId._id - _seqIdOffest];
+	return this->getRecord(newId);
 }
 
-size_t SequenceContainer::readFasta(std::vector<FastaRecord>& record, 
-									const std::string& fileName)
+void SequenceContainer::parseFasta(char* pos, char* end, size_t& lineNo,
+								   std::vector<FastaRecord>& records)
 {
-	size_t BUF_SIZE = 32 * 1024 * 1024;
-	char* rawBuffer = new char[BUF_SIZE];
-	auto* fd = gzopen(fileName.c_str(), "rb");
-	if (!fd)
-	{
-		delete[] rawBuffer;
-		throw ParseException("Can't open reads file");
-	}
-
-	record.clear();
-	int lineNo = 1;
-	std::string header; 
+	std::minstd_rand randGen(lineNo);
+	std::string header;
 	std::string sequence;
-	std::string nextLine;
-	try
+	char* lineBegin = nullptr;
+	char* lineEnd = nullptr;
+	while (pos < end)
 	{
-		while(!gzeof(fd))
+		nextLine(pos, end, lineBegin, lineEnd);
+		if (lineBegin == lineEnd) 
 		{
-			//get a new line
-			for (;;)
-			{
-				char* read = gzgets(fd, rawBuffer, BUF_SIZE);
-				if (!read) break;
-				nextLine += read;
-				if (nextLine.empty()) break;
-				if (nextLine.back() == '\n')
-				{
-					nextLine.pop_back();
-					break;
-				}
-			}
-
-			if (nextLine.empty()) continue;
-			if (nextLine.back() == '\r') nextLine.pop_back();
+			++lineNo;
+			continue;
+		}
 
-			if (nextLine[0] == '>')
+		if (*lineBegin == '>')
+		{
+			if (!header.empty())
 			{
-				if (!header.empty())
-				{
-					if (sequence.empty()) throw ParseException("empty sequence");
+				if (sequence.empty()) throw ParseException("empty sequence");
 
-					record.emplace_back(DnaSequence(sequence), header, 
-										FastaRecord::ID_NONE);
-					sequence.clear();
-					header.clear();
-				}
-				this->validateHeader(nextLine);
-				header = nextLine;
+				records.emplace_back(DnaSequence(sequence), header, 
+									 FastaRecord::ID_NONE);
+				sequence.clear();
 			}
-			else
-			{
-				this->validateSequence(nextLine);
-				std::copy(nextLine.begin(), nextLine.end(), 
-						  std::back_inserter(sequence));
-			}
-
-			++lineNo;
-			nextLine.clear();
+			header = this->validateHeader(lineBegin, lineEnd);
+			//seeded per record, so that the result does not depend
+			//on how the input is split between the threads
+			randGen.seed(lineNo);
 		}
-		
-		if (sequence.empty()) throw ParseException("empty sequence");
-		if (header.empty())
+		else
 		{
-			throw ParseException("Fasta fromat error");
+			if (header.empty()) throw ParseException("Fasta fromat error");
+			this->validateSequence(lineBegin, lineEnd, randGen);
+			sequence.append(lineBegin, lineEnd);
 		}
-		record.emplace_back(DnaSequence(sequence), header, 
-							FastaRecord::ID_NONE);
-
+		++lineNo;
 	}
-	catch (ParseException& e)
+
+	if (!header.empty())
 	{
-		std::stringstream ss;
-		ss << "parse error in " << fileName << " on line " << lineNo << ": " << e.what();
-		gzclose(fd);
-		throw ParseException(ss.str());
+		if (sequence.empty()) throw ParseException("empty sequence");
+		records.emplace_back(DnaSequence(sequence), header, 
+							 FastaRecord::ID_NONE);
 	}
-
-	delete[] rawBuffer;
-	gzclose(fd);
-	return record.size();
 }
 
-size_t SequenceContainer::readFastq(std::vector<FastaRecord>& record, 
-									const std::string& fileName)
+void SequenceContainer::parseFastq(char* pos, char* end, size_t& lineNo,
+								   std::vector<FastaRecord>& records,
+								   size_t& trimmedBases)
 {
-
-	size_t BUF_SIZE = 32 * 1024 * 1024;
-	char* rawBuffer = new char[BUF_SIZE];
-	auto* fd = gzopen(fileName.c_str(), "rb");
-	if (!fd)
-	{
-		delete[] rawBuffer;
-		throw ParseException("Can't open reads file");
-	}
-
-	record.clear();
-	int lineNo = 1;
+	std::minstd_rand randGen(lineNo);
 	int stateCounter = 0;
-	std::string header; 
-	std::string nextLine;
-	try
+	std::string header;
+	char* lineBegin = nullptr;
+	char* lineEnd = nullptr;
+	char* seqBegin = nullptr;
+	char* seqEnd = nullptr;
+	while (pos < end)
 	{
-		while (!gzeof(fd))
+		nextLine(pos, end, lineBegin, lineEnd);
+		if (lineBegin == lineEnd)
 		{
-			//get a new line
-			for (;;)
-			{
-				char* read = gzgets(fd, rawBuffer, BUF_SIZE);
-				if (!read) break;
-				nextLine += read;
-				if (nextLine.empty()) break;
-				if (nextLine.back() == '\n')
-				{
-					nextLine.pop_back();
-					break;
-				}
-			}
+			stateCounter = (stateCounter + 1) % 4;
+			continue;
+		}
 
-			if (nextLine.empty()) 
+		if (stateCounter == 0)
+		{
+			if (*lineBegin != '@') throw ParseException("Fastq format error");
+			header = this->validateHeader(lineBegin, lineEnd);
+			randGen.seed(lineNo);
+			seqBegin = nullptr;
+			seqEnd = nullptr;
+		}
+		else if (stateCounter == 1)
+		{
+			this->validateSequence(lineBegin, lineEnd, randGen);
+			if (_trimMinQuality > 0)
 			{
-				stateCounter = (stateCounter + 1) % 4;
-				continue;
+				//the record is added once the quality line is parsed
+				seqBegin = lineBegin;
+				seqEnd = lineEnd;
 			}
-			if (nextLine.back() == '\r') nextLine.pop_back();
-
-			if (stateCounter == 0)
+			else
 			{
-				if (nextLine[0] != '@') throw ParseException("Fastq format error");
-				header = nextLine;
-				this->validateHeader(header);
+				records.emplace_back(DnaSequence(lineBegin, lineEnd - lineBegin), 
+									 header, FastaRecord::ID_NONE);
 			}
-			else if (stateCounter == 1)
+		}
+		else if (stateCounter == 2)
+		{
+			if (*lineBegin != '+') throw ParseException("Fastq fromat error");
+		}
+		else if (stateCounter == 3 && seqBegin)
+		{
+			const size_t seqLength = seqEnd - seqBegin;
+			if ((size_t)(lineEnd - lineBegin) != seqLength)
 			{
-				this->validateSequence(nextLine);
-				record.emplace_back(DnaSequence(nextLine), header, 
-									FastaRecord::ID_NONE);
+				throw ParseException("Fastq format error: sequence and "
+									 "quality lengths differ");
 			}
-			else if (stateCounter == 2)
+			size_t trimStart = 0;
+			size_t trimLength = 0;
+			qualityTrim(lineBegin, seqLength, _trimMinQuality, 
+						std::max(_trimWindow, 1), _trimLongestSegment,
+						trimStart, trimLength);
+			trimmedBases += seqLength - trimLength;
+			if (trimLength > 0)
 			{
-				if (nextLine[0] != '+') throw ParseException("Fastq fromat error");
+				records.emplace_back(DnaSequence(seqBegin + trimStart, trimLength), 
+									 header, FastaRecord::ID_NONE);
 			}
-			stateCounter = (stateCounter + 1) % 4;
-			++lineNo;
-			nextLine.clear();
 		}
+		stateCounter = (stateCounter + 1) % 4;
+		++lineNo;
 	}
-	catch (ParseException& e)
-	{
-		std::stringstream ss;
-		ss << "parse error in " << fileName << " on line " << lineNo << ": " << e.what();
-		gzclose(fd);
-		throw ParseException(ss.str());
-	}
-
-	gzclose(fd);
-	delete[] rawBuffer;
-	return record.size();
 }
 
-
-void SequenceContainer::validateHeader(std::string& header)
+std::string SequenceContainer::validateHeader(const char* begin, 
+											 const char* end)
 {
-	size_t delim = 0;
-	for (delim = 0; delim < header.length(); ++delim)
-	{
-		if (std::isspace(header[delim])) break;
-	}
+	const char* delim = begin;
+	while (delim != end && !std::isspace(*delim)) ++delim;
 
-	header = header.substr(1, delim - 1);
-	if (header.empty()) throw ParseException("empty header");
+	if (delim - begin <= 1) throw ParseException("empty header");
+	return std::string(begin + 1, delim);
 }
 
-void SequenceContainer::validateSequence(std::string& sequence)
+void SequenceContainer::validateSequence(char* begin, char* end,
+										 std::minstd_rand& randGen)
 {
-	const std::string VALID_CHARS = "ACGT";
-	for (size_t i = 0; i < sequence.length(); ++i)
+	const char VALID_CHARS[] = "ACGT";
+	for (char* pos = begin; pos != end; ++pos)
 	{
-		if (DnaSequence::dnaToId(sequence[i]) == -1U)
+		if (DnaSequence::dnaToId(*pos) == -1U)
 		{
-			sequence[i] = VALID_CHARS[rand() % 4];
+			*pos = VALID_CHARS[randGen() % 4];
 		}
 	}
 }
@@ -343,10 +862,11 @@ void SequenceContainer::writeFasta(const std::vector<FastaRecord>& records,
 	{
 		if (onlyPositiveStrand && !rec.id.strand()) continue;
 
+		const std::string fullSeq = rec.sequence.str();
 		std::string contigSeq;
-		for (size_t c = 0; c < rec.sequence.length(); c += FASTA_SLICE)
+		for (size_t c = 0; c < fullSeq.length(); c += FASTA_SLICE)
 		{
-			contigSeq += rec.sequence.substr(c, FASTA_SLICE).str() + "\n";
+			contigSeq += fullSeq.substr(c, FASTA_SLICE) + "\n";
 		}
 		std::string header = onlyPositiveStrand ? 
 							 ">" + rec.description.substr(1) + "\n":
@@ -362,34 +882,248 @@ void SequenceContainer::writeFasta(const std::vector<FastaRecord>& records,
 void SequenceContainer::buildPositionIndex()
 {
 	Logger::get().debug() << "Building positional index";
-	size_t offset = 0;
-	_sequenceOffsets.reserve(_seqIndex.size());
-	for (const auto& seq : _seqIndex)
+	if (_sequences.size() >= std::numeric_limits<uint32_t>::max())
 	{
-		_sequenceOffsets.push_back({offset, seq.sequence.length()});
-		offset += seq.sequence.length();
+		throw std::runtime_error("Too many sequences");
 	}
-	_sequenceOffsets.push_back({offset, 0});
-	if (offset == 0) return;
-
-	_offsetsHint.reserve(offset / CHUNK + 1);
-	size_t idx = 0;
-	for (size_t i = 0; i <= (offset - 1) / CHUNK; ++i)
+	//the reverse strand has the same length and follows the forward one
+	_pairOffsets.clear();
+	_pairOffsets.reserve(_sequences.size() / 2 + 1);
+	size_t offset = 0;
+	for (size_t i = 0; i < _sequences.size(); i += 2)
 	{
-		while (i * CHUNK >= _sequenceOffsets[idx + 1].offset) ++idx;
-		//size_t newIdx = std::upper_bound(_sequenceOffsets.begin(), 
-		//							     _sequenceOffsets.end(),
-		//							     i * CHUNK) - _sequenceOffsets.begin();
-		//Logger::get().debug() << idx << " " << newIdx;
-		//assert(idx == newIdx);
-		_offsetsHint.push_back(idx);
+		_pairOffsets.emplace_back(offset);
+		offset += _sequences[i].length();
 	}
+	_pairOffsets.emplace_back(offset);
+	_offsetsHint.clear();
+	_denseHints.clear();
 
-	Logger::get().debug() << "Total sequence: " << offset / 2 << " bp";
-	if (offset >= MAX_SEQUENCE)
+	Logger::get().debug() << "Total sequence: " << offset << " bp";
+	if (offset * 2 >= MAX_SEQUENCE)
 	{
 		Logger::get().error() << "Maximum sequence limit reached ("
 			<< MAX_SEQUENCE / 2 << ")";
 		throw std::runtime_error("Input overflow");
 	}
+	if (offset == 0) return;
+
+	const size_t numPairs = _pairOffsets.size() - 1;
+	const size_t numHints = ((offset - 1) >> HINT_BITS) + 1;
+	_offsetsHint.reserve(numHints);
+	size_t pairIdx = 0;
+	for (size_t i = 0; i < numHints; ++i)
+	{
+		const size_t blockStart = i << HINT_BITS;
+		while (_pairOffsets[pairIdx + 1] <= blockStart) ++pairIdx;
+
+		//starts of the next sequences within the block
+		DenseHint dense;
+		std::fill(dense.starts, dense.starts + HINT_STEP / 64, 0);
+		dense.firstPair = pairIdx;
+		dense.firstStart = blockStart - _pairOffsets[pairIdx];
+		dense.lastEnd = _pairOffsets[pairIdx + 1] - blockStart;
+		size_t numStarts = 0;
+		bool emptySeqs = false;
+		for (size_t next = pairIdx + 1; next < numPairs && 
+			 _pairOffsets[next] < blockStart + HINT_STEP; ++next)
+		{
+			const size_t blockPos = _pairOffsets[next] - blockStart;
+			dense.starts[blockPos / 64] |= 1ULL << (blockPos % 64);
+			dense.lastEnd = _pairOffsets[next + 1] - blockStart;
+			emptySeqs |= _pairOffsets[next + 1] == 
+						 _pairOffsets[next];
+			++numStarts;
+		}
+		uint8_t wordRank = 0;
+		for (size_t w = 0; w < HINT_STEP / 64; ++w)
+		{
+			dense.wordRanks[w] = wordRank;
+			wordRank += __builtin_popcountll(dense.starts[w]);
+		}
+		if (numStarts <= 1 || emptySeqs)
+		{
+			_offsetsHint.push_back(pairIdx);
+		}
+		else
+		{
+			_offsetsHint.push_back(DENSE_HINT | _denseHints.size());
+			_denseHints.push_back(dense);
+		}
+	}
+	_denseHints.shrink_to_fit();
+	Logger::get().debug() << "Positional index: " << numHints << " hints, "
+		<< _denseHints.size() << " with several sequence starts";
+}
+
+size_t SequenceContainer::positionIndexSize() const
+{
+	return _pairOffsets.capacity() * sizeof(size_t) +
+		   _offsetsHint.capacity() * sizeof(uint32_t) +
+		   _denseHints.capacity() * sizeof(DenseHint);
+}
+
+void SequenceContainer::buildHpcIndex()
+{
+	Logger::get().debug() << "Building HPC index";
+	_hpcSequences.assign(_names.size(), HpcSequence());
+	std::vector<size_t> seqIds(_names.size());
+	for (size_t i = 0; i < seqIds.size(); ++i) seqIds[i] = i;
+	std::function<void(const size_t&)> compressFunc = 
+	[this] (const size_t& seqId)
+	{
+		_hpcSequences[seqId] = HpcSequence(_sequences[seqId * 2]);
+	};
+	processInParallel(seqIds, compressFunc, 
+					  Parameters::get().numThreads, false);
+
+	size_t memory = 0;
+	for (const auto& hpcSeq : _hpcSequences) memory += hpcSeq.memoryUsage();
+	Logger::get().debug() << "HPC index size: " << memory / 1024 / 1024 << " Mb";
+}
+
+bool SequenceContainer::isPacked(const std::string& fileName)
+{
+	FILE* fin = fopen(fileName.c_str(), "rb");
+	if (!fin) return false;
+
+	char magic[sizeof(PACKED_MAGIC)];
+	bool packed = fread(magic, 1, sizeof(magic), fin) == sizeof(magic) &&
+				  !memcmp(magic, PACKED_MAGIC, sizeof(magic));
+	fclose(fin);
+	return packed;
+}
+
+void SequenceContainer::writePacked(const std::string& fileName) const
+{
+	Logger::get().debug() << "Writing packed sequences";
+
+	std::vector<PackedEntry> table;
+	std::string names;
+	uint64_t totalChunks = 0;
+	for (size_t i = 0; i < _names.size(); ++i)
+	{
+		const DnaSequence& sequence = _sequences[i * 2];
+		table.push_back({totalChunks, sequence.length(), 
+						 names.size(), _names[i].size()});
+		names += _names[i];
+		totalChunks += DnaSequence::numChunks(sequence.length());
+	}
+
+	PackedHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, PACKED_MAGIC, sizeof(PACKED_MAGIC));
+	header.version = PACKED_VERSION;
+	header.chunkSize = sizeof(DnaSequence::NuclType);
+	header.numSequences = table.size();
+	header.tableOffset = sizeof(PackedHeader);
+	header.namesOffset = header.tableOffset + table.size() * sizeof(PackedEntry);
+	header.chunksOffset = alignUp(header.namesOffset + names.size());
+	header.fileSize = header.chunksOffset + 
+					  totalChunks * sizeof(DnaSequence::NuclType);
+
+	FILE* fout = fopen(fileName.c_str(), "wb");
+	if (!fout) throw std::runtime_error("Can't open " + fileName);
+
+	const char padding[sizeof(uint64_t)] = {0};
+	fwrite(&header, sizeof(header), 1, fout);
+	fwrite(table.data(), sizeof(PackedEntry), table.size(), fout);
+	fwrite(names.data(), 1, names.size(), fout);
+	fwrite(padding, 1, header.chunksOffset - header.namesOffset - 
+			names.size(), fout);
+	for (size_t i = 0; i < _names.size(); ++i)
+	{
+		const DnaSequence& sequence = _sequences[i * 2];
+		const auto chunks = sequence.packedChunks();
+		fwrite(chunks.data(), sizeof(DnaSequence::NuclType), 
+			   chunks.size(), fout);
+	}
+
+	if (ferror(fout))
+	{
+		fclose(fout);
+		throw std::runtime_error("Error writing " + fileName);
+	}
+	fclose(fout);
+}
+
+size_t SequenceContainer::readPacked(const std::string& fileName,
+									 int minReadLength, 
+									 const std::function<void(FastaRecord&)>& onRecord)
+{
+	int fd = open(fileName.c_str(), O_RDONLY);
+	if (fd < 0) throw ParseException("Can't open reads file");
+
+	struct stat fileStat;
+	if (fstat(fd, &fileStat) != 0 || 
+		(size_t)fileStat.st_size < sizeof(PackedHeader))
+	{
+		close(fd);
+		throw ParseException("Truncated packed file: " + fileName);
+	}
+	const size_t fileSize = fileStat.st_size;
+	void* mapped = mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapped == MAP_FAILED) 
+	{
+		throw ParseException("Can't map packed file: " + fileName);
+	}
+	//the mapping is released when the last sequence that refers to it is gone
+	std::shared_ptr<const void> mapping(mapped, 
+		[fileSize](const void* ptr){munmap(const_cast<void*>(ptr), fileSize);});
+
+	const char* base = static_cast<const char*>(mapped);
+	const PackedHeader* header = reinterpret_cast<const PackedHeader*>(base);
+	if (header->version != PACKED_VERSION ||
+		header->chunkSize != sizeof(DnaSequence::NuclType))
+	{
+		throw ParseException("Incompatible packed file version: " + fileName);
+	}
+	//sections should follow each other within the file. The sizes
+	//are compared by division, so that the products can not overflow
+	if (header->fileSize != fileSize ||
+		header->tableOffset < sizeof(PackedHeader) ||
+		header->tableOffset > header->namesOffset ||
+		header->namesOffset > header->chunksOffset ||
+		header->chunksOffset > fileSize ||
+		header->tableOffset % sizeof(uint64_t) != 0 ||
+		header->chunksOffset % sizeof(uint64_t) != 0 ||
+		(header->namesOffset - header->tableOffset) % sizeof(PackedEntry) != 0 ||
+		(header->namesOffset - header->tableOffset) / sizeof(PackedEntry) != 
+			header->numSequences)
+	{
+		throw ParseException("Corrupted packed file: " + fileName);
+	}
+
+	const PackedEntry* table = 
+		reinterpret_cast<const PackedEntry*>(base + header->tableOffset);
+	const DnaSequence::NuclType* chunks = 
+		reinterpret_cast<const DnaSequence::NuclType*>(base + header->chunksOffset);
+	const size_t totalChunks = (fileSize - header->chunksOffset) / 
+							   sizeof(DnaSequence::NuclType);
+	const size_t namesSize = header->chunksOffset - header->namesOffset;
+
+	size_t numLoaded = 0;
+	for (size_t i = 0; i < header->numSequences; ++i)
+	{
+		const PackedEntry& entry = table[i];
+		if (entry.chunkOffset > totalChunks ||
+			DnaSequence::numChunks(entry.length) > totalChunks - entry.chunkOffset ||
+			entry.nameOffset > namesSize ||
+			entry.nameLength > namesSize - entry.nameOffset)
+		{
+			throw ParseException("Corrupted packed file: " + fileName);
+		}
+		if (entry.length <= (size_t)minReadLength) continue;
+
+		std::string name(base + header->namesOffset + entry.nameOffset, 
+						 entry.nameLength);
+		FastaRecord record(DnaSequence::fromChunks(chunks + entry.chunkOffset, 
+												   entry.length, mapping),
+						   name, FastaRecord::ID_NONE);
+		onRecord(record);
+		++numLoaded;
+	}
+
+	return numLoaded;
 }
@@ -9,8 +9,11 @@
 #include <unordered_map>
 #include <string>
 #include <limits>
+#include <random>
+#include <functional>
 
 #include "sequence.h"
+#include "hpc_sequence.h"
 
 struct FastaRecord
 {
@@ -149,128 +152,307 @@ public:
 		{}
 	};
 
-	typedef std::vector<FastaRecord> SequenceIndex;
+	//Only the forward strand name is stored, the reverse complement
+	//record is generated on the fly. Both strands share the same
+	//DnaSequence buffer.
+	struct SeqRecordRef
+	{
+		FastaRecord::Id id;
+		const DnaSequence& sequence;
+	};
+
+	class SeqIterator
+	{
+	public:
+		typedef std::forward_iterator_tag iterator_category;
+
+		SeqIterator(const SequenceContainer& container, size_t index):
+			_container(container), _index(index) {}
+
+		bool operator==(const SeqIterator& other) const
+			{return _index == other._index;}
+		bool operator!=(const SeqIterator& other) const
+			{return !(*this == other);}
+
+		SeqRecordRef operator*() const
+		{
+			return {FastaRecord::Id(_container._seqIdOffest + _index),
+					_container._sequences[_index]};
+		}
+
+		SeqIterator& operator++()
+		{
+			++_index;
+			return *this;
+		}
+
+	private:
+		const SequenceContainer& _container;
+		size_t _index;
+	};
+
+	class IterHelper
+	{
+	public:
+		IterHelper(const SequenceContainer& container):
+			_container(container) {}
+
+		SeqIterator begin() const {return SeqIterator(_container, 0);}
+		SeqIterator end() const 
+			{return SeqIterator(_container, _container._sequences.size());}
+		size_t size() const {return _container._sequences.size();}
+		SeqRecordRef operator[](size_t index) const
+			{return *SeqIterator(_container, index);}
+
+	private:
+		const SequenceContainer& _container;
+	};
 
 	SequenceContainer():
-		_offsetInitialized(false) {}
+		_seqIdOffest(0), _offsetInitialized(false),
+		_trimMinQuality(0), _trimWindow(0), _trimLongestSegment(false) {}
+
+	//if set, fastq reads are trimmed while loading: a base passes if
+	//the mean quality of the window around it is at least minQuality.
+	//Only the low-quality read ends are removed, unless longestSegment
+	//is set - then only the longest passing segment is kept, and inner
+	//low-quality windows are cut out too. Zero quality disables trimming
+	void setQualityTrimming(int minQuality, int windowSize, 
+							bool longestSegment = false)
+	{
+		_trimMinQuality = minQuality;
+		_trimWindow = windowSize;
+		_trimLongestSegment = longestSegment;
+	}
 
 	void loadFromFile(const std::string& filename, int minReadLength = 0);
 
+	//if maxTotalLength is set, only a random subset of reads (weighted 
+	//by length) is kept, with the total length within the limit.
+	//The reads that were not selected are never stored
+	void loadFromFiles(const std::vector<std::string>& fileNames,
+					   int minReadLength = 0, size_t maxTotalLength = 0);
+
 	static void writeFasta(const std::vector<FastaRecord>& records,
 						   const std::string& fileName,
 						   bool  onlyPositiveStrand = false);
 
+	//binary file with 2-bit packed sequences that could be
+	//memory-mapped by loadFromFile instead of parsing fasta/q
+	void writePacked(const std::string& fileName) const;
+	static bool isPacked(const std::string& fileName);
+
 	static size_t getMaxSeqId() {return g_nextSeqId;}
 
-	const FastaRecord&  addSequence(const DnaSequence& sequence, 
-									const std::string& description);
+	FastaRecord addSequence(const DnaSequence& sequence, 
+							const std::string& description);
 
-	const SequenceIndex& iterSeqs() const
+	//iterates over both strands
+	IterHelper iterSeqs() const
 	{
-		return _seqIndex;
+		return IterHelper(*this);
 	}
 
-	const FastaRecord& getRecord(FastaRecord::Id seqId) const
+	FastaRecord getRecord(FastaRecord::Id seqId) const
 	{
-		assert(seqId._id - _seqIdOffest < _seqIndex.size());
-		assert(_seqIndex[seqId._id - _seqIdOffest].id == seqId);
-		return _seqIndex[seqId._id - _seqIdOffest];
+		return FastaRecord(this->getSeq(seqId), this->seqName(seqId), seqId);
 	}
 
 	const DnaSequence& getSeq(FastaRecord::Id readId) const
 	{
-		assert(readId._id - _seqIdOffest < _seqIndex.size());
-		assert(_seqIndex[readId._id - _seqIdOffest].id == readId);
-		return _seqIndex[readId._id - _seqIdOffest].sequence;
+		assert(readId._id - _seqIdOffest < _sequences.size());
+		return _sequences[readId._id - _seqIdOffest];
 	}
 
 	int32_t seqLen(FastaRecord::Id readId) const
 	{
-		assert(readId._id - _seqIdOffest < _seqIndex.size());
-		assert(_seqIndex[readId._id - _seqIdOffest].id == readId);
-		return _seqIndex[readId._id - _seqIdOffest].sequence.length();
+		assert(readId._id - _seqIdOffest < _sequences.size());
+		return _sequences[readId._id - _seqIdOffest].length();
 	}
 
 	std::string seqName(FastaRecord::Id readId) const
 	{
-		assert(readId._id - _seqIdOffest < _seqIndex.size());
-		assert(_seqIndex[readId._id - _seqIdOffest].id == readId);
-		return _seqIndex[readId._id - _seqIdOffest].description;
+		assert(readId._id - _seqIdOffest < _sequences.size());
+		return (readId.strand() ? "+" : "-") + 
+			   _names[(readId._id - _seqIdOffest) / 2];
 	}
 
 	int computeNxStat(float fraction) const;
 
+	//optional homopolymer-compressed companion of the sequences,
+	//which is computed once and used for the HPC alignment scoring
+	void   buildHpcIndex();
+	bool   hasHpcIndex() const {return !_hpcSequences.empty();}
+
+	void hpcRegion(FastaRecord::Id seqId, int32_t start, int32_t length,
+				   std::string& outSeq, std::vector<int32_t>& outOffsets) const
+	{
+		assert(seqId._id - _seqIdOffest < _sequences.size());
+		_hpcSequences[(seqId._id - _seqIdOffest) / 2]
+			.extract(!seqId.strand(), start, length, outSeq, outOffsets);
+	}
+
 	void   buildPositionIndex();
+	//memory used by the global position index, in bytes
+	size_t positionIndexSize() const;
 
 	size_t globalPosition(FastaRecord::Id seqId, int32_t position) const
 	{
 		assert(position >= 0 && position < this->seqLen(seqId));
-		assert(seqId._id - _seqIdOffest < _seqIndex.size());
+		assert(seqId._id - _seqIdOffest < _sequences.size());
+		const size_t seqIdx = seqId._id - _seqIdOffest;
+		const size_t pairStart = _pairOffsets[seqIdx / 2];
+		size_t globPos = 2 * pairStart + position;
+		if (seqIdx % 2) globPos += _pairOffsets[seqIdx / 2 + 1] - pairStart;
 		#ifndef NDEBUG
-		auto checkGlob = _sequenceOffsets[seqId._id - _seqIdOffest].offset + position;
 		FastaRecord::Id checkId;
 		int32_t checkPos;
 		int32_t outLen;
-		this->seqPosition(checkGlob, checkId, checkPos, outLen);
+		this->seqPosition(globPos, checkId, checkPos, outLen);
 		assert(checkId == seqId && checkPos == position);
 		#endif
-		return _sequenceOffsets[seqId._id - _seqIdOffest].offset + position;
+		return globPos;
 	}
 
-	const FastaRecord& recordByName(const std::string& name) const
+	//the name should include the strand prefix (+/-)
+	FastaRecord recordByName(const std::string& name) const
 	{
-		return this->getRecord(_nameIndex.at(name));
+		if (name.empty() || (name[0] != '+' && name[0] != '-'))
+		{
+			throw std::out_of_range("Unknown sequence: " + name);
+		}
+		FastaRecord::Id fwdId = _nameIndex.at(name.substr(1));
+		return this->getRecord(name[0] == '+' ? fwdId : fwdId.rc());
 	}
 
 	void seqPosition(size_t globPos, FastaRecord::Id& outSeqId, 
 					 int32_t& outPosition, int32_t& outLen) const
 	{
-		assert(globPos < _sequenceOffsets.back().offset);
+		//both strands of a sequence are consecutive, and the pair
+		//of strands is found by the forward position
+		const size_t fwdPos = globPos / 2;
+		assert(fwdPos < _pairOffsets.back());
+
+		//the hint is the pair that covers the block start. The next 
+		//pair starts within the block at most once, otherwise the hint
+		//refers to the bit vector of the pair starts in the block
+		size_t pairIdx = _offsetsHint[fwdPos >> HINT_BITS];
+		size_t pairStart = 0;
+		size_t pairEnd = 0;
+		if (pairIdx & DENSE_HINT)
+		{
+			this->denseLookup(_denseHints[pairIdx & ~DENSE_HINT], fwdPos,
+							  pairIdx, pairStart, pairEnd);
+		}
+		else
+		{
+			//more than one step is only needed to skip empty sequences
+			while (_pairOffsets[pairIdx + 1] <= fwdPos) ++pairIdx;
+			pairStart = _pairOffsets[pairIdx];
+			pairEnd = _pairOffsets[pairIdx + 1];
+		}
 
-		size_t hint = _offsetsHint[globPos / CHUNK];
-		while (_sequenceOffsets[hint + 1].offset <= globPos) ++hint;
+		const size_t length = pairEnd - pairStart;
+		const size_t pairPos = globPos - 2 * pairStart;
+		const size_t revStrand = pairPos >= length;	//random, so no branch
 
-		outSeqId = FastaRecord::Id(_seqIdOffest + hint);
-		outPosition = globPos - _sequenceOffsets[hint].offset;
-		outLen = (int32_t)_sequenceOffsets[hint].length;
+		outSeqId = FastaRecord::Id(_seqIdOffest + pairIdx * 2 + revStrand);
+		outPosition = pairPos - revStrand * length;
+		outLen = (int32_t)length;
 
-		assert(outSeqId._id - _seqIdOffest < _seqIndex.size());
+		assert(outSeqId._id - _seqIdOffest < _sequences.size());
 		assert(outPosition >= 0 && outPosition < outLen);
 		//assert(this->globalPosition(outSeqId, outPosition) == globPos);
 	}
 	static size_t g_nextSeqId;
 
 private:
-	struct OffsetPair
-	{
-		size_t offset;
-		size_t length;
-	};
-
 	FastaRecord::Id addSequence(const FastaRecord& sequence);
 
-	size_t readFasta(std::vector<FastaRecord>& record, 
-				     const std::string& fileName);
+	void   readFile(const std::string& fileName, int minReadLength,
+					const std::function<void(FastaRecord&)>& onRecord);
+
+	size_t readPacked(const std::string& fileName, int minReadLength,
+					  const std::function<void(FastaRecord&)>& onRecord);
 
-	size_t readFastq(std::vector<FastaRecord>& record, 
-				     const std::string& fileName);
+	void   parseFasta(char* begin, char* end, size_t& lineNo,
+					  std::vector<FastaRecord>& records);
+
+	void   parseFastq(char* begin, char* end, size_t& lineNo,
+					  std::vector<FastaRecord>& records,
+					  size_t& trimmedBases);
 
 	bool   isFasta(const std::string& fileName);
 
-	void   validateSequence(std::string& sequence);
+	void   validateSequence(char* begin, char* end, std::minstd_rand& randGen);
 
-	void   validateHeader(std::string& header);
+	std::string validateHeader(const char* begin, const char* end);
 
-	SequenceIndex 	_seqIndex;
+	std::vector<DnaSequence> _sequences;	//both strands
+	std::vector<std::string> _names;		//forward strand only
+	std::vector<HpcSequence> _hpcSequences;	//forward strand only
 	size_t 			_seqIdOffest;
 	bool   			_offsetInitialized;
+	int				_trimMinQuality;
+	int				_trimWindow;
+	bool			_trimLongestSegment;
 	std::unordered_map<std::string, 
 					   FastaRecord::Id> _nameIndex;
 
-	//global/local position convertions
+	//global/local position convertions. Both strands of a sequence
+	//are consecutive in the global positions, so only the starts
+	//of the forward strands are stored (in forward bases). Every 
+	//HINT_STEP forward bases there is a 4-byte hint: the sequence 
+	//that covers the start of the block. If more than one other
+	//sequence starts within the block, the hint refers to a bit
+	//vector of these starts instead, which are counted to find
+	//the sequence, and give its bounds without reading the offsets.
+	//So the lookup takes constant time (except for the blocks with 
+	//empty sequences, which are skipped one by one) and uses 8 bytes
+	//per sequence, 16 bytes per kb of forward sequence, and 48 bytes
+	//per block with several sequence starts
+	static const size_t HINT_BITS = 8;
+	static const size_t HINT_STEP = 1ULL << HINT_BITS;
+	static const uint32_t DENSE_HINT = 1U << 31;
+	struct DenseHint
+	{
+		uint64_t starts[HINT_STEP / 64];
+		uint32_t firstPair;
+		uint32_t firstStart;	//before the block start
+		uint32_t lastEnd;		//after the block start
+		uint8_t  wordRanks[HINT_STEP / 64];	//starts before each word
+	};
 	const size_t MAX_SEQUENCE = 1ULL << (8 * 5);
-	const size_t CHUNK = 1000;
-	std::vector<OffsetPair> _sequenceOffsets;
-	std::vector<size_t> 	_offsetsHint;
+
+	//the pair is given by the number of the starts up to the position,
+	//its bounds - by the closest starts, or the bounds of the first 
+	//and the last pair, if outside of the block
+	void denseLookup(const DenseHint& dense, size_t fwdPos, size_t& outPair,
+					 size_t& outStart, size_t& outEnd) const
+	{
+		const size_t blockStart = fwdPos & ~(HINT_STEP - 1);
+		const size_t lastWord = (fwdPos - blockStart) / 64;
+		const uint64_t lastMask = (2ULL << (fwdPos % 64)) - 1;
+		outPair = dense.firstPair + dense.wordRanks[lastWord] + 
+				  __builtin_popcountll(dense.starts[lastWord] & lastMask);
+		outStart = blockStart - dense.firstStart;
+		for (size_t i = 0; i <= lastWord; ++i)
+		{
+			const uint64_t word = i < lastWord ? dense.starts[i] : 
+												 dense.starts[i] & lastMask;
+			if (word) outStart = blockStart + i * 64 + 63 - __builtin_clzll(word);
+		}
+		outEnd = blockStart + dense.lastEnd;
+		for (size_t i = HINT_STEP / 64; i-- > lastWord; )
+		{
+			const uint64_t word = i > lastWord ? dense.starts[i] : 
+												 dense.starts[i] & ~lastMask;
+			if (word) outEnd = blockStart + i * 64 + __builtin_ctzll(word);
+		}
+	}
+
+	std::vector<size_t> 	_pairOffsets;
+	std::vector<uint32_t> 	_offsetsHint;
+	std::vector<DenseHint> 	_denseHints;
 };
 
@@ -3,11 +3,15 @@
 //Released under the BSD license (see LICENSE file)
 
 #include <stdexcept>
+#include <cassert>
 #include <iostream>
 #include <unordered_set>
 #include <algorithm>
 #include <queue>
 #include <cmath>
+#include <cstdio>
+#include <numeric>
+#include <limits>
 
 #include "vertex_index.h"
 #include "../common/logger.h"
@@ -15,10 +19,18 @@
 #include "../common/config.h"
 #include "../common/memory_info.h"
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+//the batch size is also passed by reference (e.g. to std::min)
+const size_t VertexIndex::QUERY_BATCH;
+
 
 void VertexIndex::countKmers()
 {
-	_kmerCounter.count(/*use flat counter*/ true);
+	_kmerCounter.count();
 }
 
 
@@ -29,99 +41,109 @@ void VertexIndex::buildIndexUnevenCoverage(int globalMinFreq, float selectRate,
 
 	//_solidMultiplier = 1;
 
-	std::vector<FastaRecord::Id> allReads;
+	std::vector<FastaRecord::Id> forwardReads;
+	size_t totalLen = 0;
 	for (const auto& seq : _seqContainer.iterSeqs())
 	{
-		allReads.push_back(seq.id);
+		if (!seq.id.strand()) continue;
+		forwardReads.push_back(seq.id);
+		totalLen += seq.sequence.length();
 	}
+	std::vector<size_t> readIds(forwardReads.size());
+	std::iota(readIds.begin(), readIds.end(), 0);
+
+	//if they fit into memory, k-mers selected in the first pass are kept,
+	//so the second pass does not need to process the reads again
+	const bool singlePass = totalLen * selectRate * sizeof(SelectedKmer) < 
+							getFreeMemorySize() / 2;
+	std::vector<std::vector<SelectedKmer>> 
+		selectedKmers(singlePass ? forwardReads.size() : 0);
+	Logger::get().debug() << "Keeping selected k-mers between passes: " 
+		<< "NY"[singlePass];
 
 	//first, count the number of k-mers that will be actually stored in the index
 	_kmerIndex.reserve(_kmerCounter.getKmerNum() / 10);
 	if (_outputProgress) Logger::get().info() << "Filling index table (1/2)";
-	std::function<void(const FastaRecord::Id&)> initializeIndex = 
-	[this, globalMinFreq, selectRate, tandemFreq] (const FastaRecord::Id& readId)
+	std::function<void(const size_t&)> initializeIndex = 
+	[this, globalMinFreq, selectRate, tandemFreq, singlePass, 
+	 &forwardReads, &selectedKmers] (const size_t& readId)
 	{
-		if (!readId.strand()) return;
-
-		auto topKmers = this->yieldFrequentKmers(readId, selectRate, tandemFreq);
+		auto topKmers = this->yieldFrequentKmers(forwardReads[readId], 
+												 selectRate, tandemFreq);
 		for (auto kmerFreq : topKmers)
 		{
-			kmerFreq.kmer.standardForm();
-
 			if (kmerFreq.freq < (size_t)globalMinFreq) continue;
 
 			ReadVector defVec((uint32_t)1, (uint32_t)0);
 			_kmerIndex.upsert(kmerFreq.kmer, 
 							  [](ReadVector& rv){++rv.capacity;}, defVec);
 		}
+
+		if (!singlePass) return;
+		auto& readKmers = selectedKmers[readId];
+		readKmers.reserve(std::count_if(topKmers.begin(), topKmers.end(),
+						  [globalMinFreq](const KmerFreq& kf)
+						  {return kf.freq >= (size_t)globalMinFreq;}));
+		for (auto kmerFreq : topKmers)
+		{
+			if (kmerFreq.freq < (size_t)globalMinFreq) continue;
+
+			uint32_t position = kmerFreq.position;
+			if (kmerFreq.revComp) position |= REV_COMP_BIT;
+			readKmers.push_back({kmerFreq.kmer.numRepr(), position, 
+								 (uint32_t)std::min(kmerFreq.freq, 
+								 			(size_t)std::numeric_limits<uint32_t>::max())});
+		}
 	};
-	processInParallel(allReads, initializeIndex, 
+	processInParallel(readIds, initializeIndex, 
 					  Parameters::get().numThreads, _outputProgress);
 	
 	this->filterFrequentKmers(globalMinFreq, (float)Config::get("repeat_kmer_rate"));
+	//k-mer counts are not needed for the second pass
+	if (singlePass) _kmerCounter.clear();
 	this->allocateIndexMemory();
 
 	if (_outputProgress) Logger::get().info() << "Filling index table (2/2)";
-	std::function<void(const FastaRecord::Id&)> indexUpdate = 
-	[this, globalMinFreq, selectRate, tandemFreq] (const FastaRecord::Id& readId)
+	std::function<void(const size_t&)> indexUpdate = 
+	[this, globalMinFreq, selectRate, tandemFreq, singlePass,
+	 &forwardReads, &selectedKmers] (const size_t& readId)
 	{
-		if (!readId.strand()) return;
+		if (singlePass)
+		{
+			for (const auto& selKmer : selectedKmers[readId])
+			{
+				if (selKmer.freq > _repetitiveFrequency) continue;
+				this->addIndexPosition(forwardReads[readId], Kmer(selKmer.kmer),
+									   selKmer.position & ~REV_COMP_BIT,
+									   selKmer.position & REV_COMP_BIT);
+			}
+			std::vector<SelectedKmer>().swap(selectedKmers[readId]);
+			return;
+		}
 
-		auto topKmers = this->yieldFrequentKmers(readId, selectRate, tandemFreq);
+		auto topKmers = this->yieldFrequentKmers(forwardReads[readId], 
+												 selectRate, tandemFreq);
 		for (auto kmerFreq : topKmers)
 		{
 			if (kmerFreq.freq < (size_t)globalMinFreq ||
 				kmerFreq.freq > _repetitiveFrequency) continue;
 
-			KmerPosition kmerPos(kmerFreq.kmer, kmerFreq.position);
-			FastaRecord::Id targetRead = readId;
-			bool revCmp = kmerPos.kmer.standardForm();
-			if (revCmp)
-			{
-				kmerPos.position = _seqContainer.seqLen(readId) - 
-										kmerPos.position -
-										Parameters::get().kmerSize;
-				targetRead = targetRead.rc();
-			}
-
-			//will not trigger update for k-mer not in the index
-			_kmerIndex.update_fn(kmerPos.kmer, 
-				[targetRead, &kmerPos, this](ReadVector& rv)
-				{
-					if (rv.size == rv.capacity) 
-					{
-						Logger::get().warning() << "Index size mismatch " << rv.capacity;
-						return;
-					}
-					size_t globPos = _seqContainer
-							.globalPosition(targetRead, kmerPos.position);
-					rv.data[rv.size].set(globPos);
-					++rv.size;
-				});
+			this->addIndexPosition(forwardReads[readId], kmerFreq.kmer, 
+								   kmerFreq.position, kmerFreq.revComp);
 		}
 	};
-	processInParallel(allReads, indexUpdate, 
+	processInParallel(readIds, indexUpdate, 
 					  Parameters::get().numThreads, _outputProgress);
 
 	_kmerCounter.clear();
 
-	Logger::get().debug() << "Sorting k-mer index";
-	for (const auto& kmerVec : _kmerIndex.lock_table())
-	{
-		std::sort(kmerVec.second.data, kmerVec.second.data + kmerVec.second.size,
-				  [](const IndexChunk& p1, const IndexChunk& p2)
-				  	{return p1.get() < p2.get();});
-	}
-	
-	size_t totalEntries = 0;
-	for (const auto& kmerRec : _kmerIndex.lock_table())
-	{
-		totalEntries += kmerRec.second.size;
-	}
-	Logger::get().debug() << "Selected k-mers: " << _kmerIndex.size();
+	this->finalizeIndex();
+	const size_t totalEntries = _indexPositions.size();
+	const size_t indexedKmers = _indexKmers.size() - _numRepetitive;
+	Logger::get().debug() << "Selected k-mers: " << indexedKmers;
 	Logger::get().debug() << "Index size: " << totalEntries;
 	Logger::get().debug() << "Mean k-mer index frequency: " 
-		<< (float)totalEntries / _kmerIndex.size();
+		<< (float)totalEntries / indexedKmers;
 }
 
 namespace
@@ -151,22 +173,18 @@ void VertexIndex::filterFrequentKmers(int minCoverage, float rate)
 	float meanFrequency = (float)totalKmers / (uniqueKmers + 1);
 	_repetitiveFrequency = rate * meanFrequency;
 	
+	//repetitive k-mers stay in the index with zero capacity
 	size_t repetitiveKmers = 0;
-	for (const auto& kmer : _kmerIndex.lock_table())
+	for (auto& kmer : _kmerIndex.lock_table())
 	{
 		if (kmer.second.capacity > _repetitiveFrequency)
 		{
 			//++repetitiveKmers;
 			repetitiveKmers += kmer.second.capacity;
-			_repetitiveKmers.insert(kmer.first, true);
+			kmer.second.capacity = 0;
 		}
 	}
 
-	for (const auto& kmer : _repetitiveKmers.lock_table())
-	{
-		_kmerIndex.erase(kmer.first);
-	}
-
 	float filteredRate = (float)repetitiveKmers / totalKmers;
 	Logger::get().debug() << "Mean k-mer frequency: " 
 						  << meanFrequency;
@@ -186,33 +204,32 @@ std::vector<VertexIndex::KmerFreq>
 	std::vector<KmerFreq> topKmers;
 	topKmers.reserve(_seqContainer.seqLen(seqId));
 
-	for (const auto& kmerPos : IterKmers(_seqContainer.getSeq(seqId)))
+	for (const auto& kmerPos : IterCanonicalKmers(_seqContainer.getSeq(seqId)))
 	{
-		auto stdKmer = kmerPos.kmer;
-		stdKmer.standardForm();
-		size_t freq = _kmerCounter.getFreq(stdKmer);
+		size_t freq = _kmerCounter.getFreq(kmerPos.kmer);
 
-		++localFreq[stdKmer];
-		topKmers.push_back({kmerPos.kmer, kmerPos.position, freq});
+		++localFreq[kmerPos.kmer];
+		topKmers.push_back({kmerPos.kmer, kmerPos.position, 
+							kmerPos.revComp, freq});
 	}
 
 	if (topKmers.empty()) return {};
-	std::sort(topKmers.begin(), topKmers.end(),
-			  [](const KmerFreq& k1, const KmerFreq& k2)
-			   {return k1.freq > k2.freq;});
+	//only the frequency threshold is needed, the order does not matter
 	const size_t maxKmers = selectRate * topKmers.size();
+	std::nth_element(topKmers.begin(), topKmers.begin() + maxKmers, 
+					 topKmers.end(), [](const KmerFreq& k1, const KmerFreq& k2)
+			   		 {return k1.freq > k2.freq;});
 	const size_t minFreq = topKmers[maxKmers].freq;
-
-	auto itVec = topKmers.begin();
-	while(itVec != topKmers.end() && itVec->freq >= minFreq) ++itVec;
-	topKmers.erase(itVec, topKmers.end());
+	topKmers.erase(std::partition(topKmers.begin(), topKmers.end(),
+								  [minFreq](const KmerFreq& kf)
+								  {return kf.freq >= minFreq;}),
+				   topKmers.end());
 
 	if (tandemFreq > 0)
 	{
 		topKmers.erase(std::remove_if(topKmers.begin(), topKmers.end(),
-							[tandemFreq](KmerFreq kf)
+							[tandemFreq](const KmerFreq& kf)
 							{
-								kf.kmer.standardForm();
 								return localFreq[kf.kmer] > (size_t)tandemFreq;
 							}), 
 					   topKmers.end());
@@ -223,36 +240,170 @@ std::vector<VertexIndex::KmerFreq>
 
 
 
+//position is given on the forward strand of the read
+void VertexIndex::addIndexPosition(const FastaRecord::Id& readId, Kmer kmer,
+								   int32_t position, bool revComp)
+{
+	//will not trigger update for k-mer not in the index
+	const size_t kmerId = this->findKmer(kmer);
+	if (kmerId == NOT_FOUND) return;
+
+	FastaRecord::Id targetRead = readId;
+	if (revComp)
+	{
+		position = _seqContainer.seqLen(readId) - position -
+				   Parameters::get().kmerSize;
+		targetRead = targetRead.rc();
+	}
+
+	//repetitive k-mers have no positions reserved
+	const size_t capacity = _indexOffsets[kmerId + 1] - _indexOffsets[kmerId];
+	if (capacity == 0) return;
+	const size_t slot = _fillCursors[kmerId].fetch_add(1, std::memory_order_relaxed);
+	if (slot >= capacity) 
+	{
+		Logger::get().warning() << "Index size mismatch " << capacity;
+		return;
+	}
+	size_t globPos = _seqContainer.globalPosition(targetRead, position);
+	_indexPositions[_indexOffsets[kmerId] + slot].set(globPos);
+}
+
+//The k-mers with their capacities are moved from the hash table
+//to the sorted array, and the positions storage is allocated.
+//K-mers with zero capacity are marked as repetitive
 void VertexIndex::allocateIndexMemory()
 {
-	_memoryChunks.push_back(new IndexChunk[MEM_CHUNK]);
-	size_t chunkOffset = 0;
-	//Important: since packed structures are apparently not thread-safe,
-	//make sure that adjacent k-mer index arrays (that are accessed in parallel)
-	//do not overlap within 8-byte window
-	const size_t PADDING = 1;
-	for (auto& kmer : _kmerIndex.lock_table())
+	std::vector<std::pair<Kmer::KmerRepr, uint32_t>> kmerCapacities;
+	kmerCapacities.reserve(_kmerIndex.size());
+	for (const auto& kmer : _kmerIndex.lock_table())
+	{
+		kmerCapacities.emplace_back(kmer.first.numRepr(), kmer.second.capacity);
+	}
+	_kmerIndex.clear();
+	_kmerIndex.reserve(0);
+	std::sort(kmerCapacities.begin(), kmerCapacities.end());
+
+	_indexKmers.clear();
+	_indexKmers.reserve(kmerCapacities.size());
+	_indexOffsets.assign(1, 0);
+	_indexOffsets.reserve(kmerCapacities.size() + 1);
+	_repetitiveFlags.assign(kmerCapacities.size() / 64 + 1, 0);
+	_numRepetitive = 0;
+	for (const auto& kmerCap : kmerCapacities)
 	{
-		if (MEM_CHUNK < kmer.second.capacity + PADDING) 
+		if (kmerCap.second == 0)
 		{
-			throw std::runtime_error("k-mer is too frequent");
+			const size_t kmerId = _indexKmers.size();
+			_repetitiveFlags[kmerId / 64] |= 1ULL << (kmerId % 64);
+			++_numRepetitive;
 		}
-		if (MEM_CHUNK - chunkOffset < kmer.second.capacity + PADDING)
+		_indexKmers.push_back(kmerCap.first);
+		_indexOffsets.push_back(_indexOffsets.back() + kmerCap.second);
+	}
+	std::vector<std::pair<Kmer::KmerRepr, uint32_t>>().swap(kmerCapacities);
+	this->buildKmerBuckets();
+
+	_indexPositions.assign(_indexOffsets.back(), IndexChunk());
+	_fillCursors.reset(new std::atomic<uint32_t>[_indexKmers.size()]);
+	for (size_t i = 0; i < _indexKmers.size(); ++i) _fillCursors[i] = 0;
+	this->updateIndexView();
+}
+
+void VertexIndex::updateIndexView()
+{
+	_mappedIndex.reset();
+	_view = IndexView();
+	if (_indexKmers.empty()) return;
+
+	_view.kmers = _indexKmers.data();
+	_view.offsets = _indexOffsets.data();
+	_view.buckets = _kmerBuckets.data();
+	_view.positions = _indexPositions.data();
+	_view.repetitive = _repetitiveFlags.data();
+	_view.numKmers = _indexKmers.size();
+	_view.bucketShift = _bucketShift;
+}
+
+//bucket directory over the top bits of the sorted k-mers,
+//about two k-mers per bucket
+void VertexIndex::buildKmerBuckets()
+{
+	const size_t kmerBits = Parameters::get().kmerSize * 2;
+	size_t bucketBits = 1;
+	while (bucketBits < kmerBits && (2ULL << bucketBits) < _indexKmers.size()) 
+	{
+		++bucketBits;
+	}
+	_bucketShift = kmerBits - bucketBits;
+
+	_kmerBuckets.assign((1ULL << bucketBits) + 1, 0);
+	for (auto kmer : _indexKmers) ++_kmerBuckets[(kmer >> _bucketShift) + 1];
+	for (size_t i = 1; i < _kmerBuckets.size(); ++i)
+	{
+		_kmerBuckets[i] += _kmerBuckets[i - 1];
+	}
+}
+
+//Sorts the positions of each k-mer. Normally, all the reserved slots
+//are filled; otherwise the unused slots are removed first
+void VertexIndex::finalizeIndex()
+{
+	bool allFilled = true;
+	for (size_t i = 0; i < _indexKmers.size() && allFilled; ++i)
+	{
+		allFilled = _fillCursors[i] >= _indexOffsets[i + 1] - _indexOffsets[i];
+	}
+	if (!allFilled)
+	{
+		size_t writePos = 0;
+		for (size_t i = 0; i < _indexKmers.size(); ++i)
 		{
-			_memoryChunks.push_back(new IndexChunk[MEM_CHUNK]);
-			chunkOffset = 0;
+			const size_t start = _indexOffsets[i];
+			const size_t size = std::min((size_t)_fillCursors[i], 
+										 _indexOffsets[i + 1] - start);
+			std::copy(_indexPositions.begin() + start, 
+					  _indexPositions.begin() + start + size,
+					  _indexPositions.begin() + writePos);
+			_indexOffsets[i] = writePos;
+			writePos += size;
 		}
-		kmer.second.data = _memoryChunks.back() + chunkOffset;
-		chunkOffset += kmer.second.capacity + PADDING;
+		_indexOffsets.back() = writePos;
+		_indexPositions.resize(writePos);
 	}
+	_fillCursors.reset();
+	this->updateIndexView();
 
-	//Logger::get().debug() << "Total chunks " << _memoryChunks.size()
-	//	<< " wasted space: " << wasted;
+	Logger::get().debug() << "Sorting k-mer index";
+	const size_t BLOCK_KMERS = 4096;
+	std::vector<size_t> blockStarts;
+	for (size_t i = 0; i < _indexKmers.size(); i += BLOCK_KMERS) 
+	{
+		blockStarts.push_back(i);
+	}
+	std::function<void(const size_t&)> sortBlock = 
+	[this, BLOCK_KMERS] (const size_t& blockStart)
+	{
+		const size_t blockEnd = std::min(blockStart + BLOCK_KMERS, 
+										 _indexKmers.size());
+		for (size_t i = blockStart; i < blockEnd; ++i)
+		{
+			std::sort(_indexPositions.begin() + _indexOffsets[i],
+					  _indexPositions.begin() + _indexOffsets[i + 1],
+					  [](const IndexChunk& p1, const IndexChunk& p2)
+					  	{return p1.get() < p2.get();});
+		}
+	};
+	processInParallel(blockStarts, sortBlock, 
+					  Parameters::get().numThreads, false);
 }
 
 void VertexIndex::buildIndexMinimizers(int minCoverage, int wndLen)
 {
+	const int sampling = Config::get("kmer_sampling");
 	if (_outputProgress) Logger::get().info() << "Building minimizer index";
+	Logger::get().debug() << "K-mer sampling: " << samplingName(sampling)
+		<< ", window " << wndLen;
 
 	std::vector<FastaRecord::Id> allReads;
 	size_t totalLen = 0;
@@ -265,17 +416,17 @@ void VertexIndex::buildIndexMinimizers(int minCoverage, int wndLen)
 	_kmerIndex.reserve(1000000);
 	if (_outputProgress) Logger::get().info() << "Pre-calculating index storage";
 	std::function<void(const FastaRecord::Id&)> initializeIndex = 
-	[this, minCoverage, wndLen] (const FastaRecord::Id& readId)
+	[this, sampling, wndLen] (const FastaRecord::Id& readId)
 	{
 		if (!readId.strand()) return;
 
-		auto minimizers = yieldMinimizers(_seqContainer.getSeq(readId), wndLen);
-		for (auto kmerPos : minimizers)
+		thread_local std::vector<CanonicalKmerPosition> minimizers;
+		yieldSampledKmers(_seqContainer.getSeq(readId), sampling, 
+						  wndLen, minimizers);
+		for (const auto& kmerPos : minimizers)
 		{
-			auto stdKmer = kmerPos.kmer;
-			stdKmer.standardForm();
 			ReadVector defVec((uint32_t)1, (uint32_t)0);
-			_kmerIndex.upsert(stdKmer, 
+			_kmerIndex.upsert(kmerPos.kmer, 
 							  [](ReadVector& rv){++rv.capacity;}, defVec);
 		}
 	};
@@ -287,98 +438,459 @@ void VertexIndex::buildIndexMinimizers(int minCoverage, int wndLen)
 	
 	if (_outputProgress) Logger::get().info() << "Filling index";
 	std::function<void(const FastaRecord::Id&)> indexUpdate = 
-	[this, minCoverage, wndLen] (const FastaRecord::Id& readId)
+	[this, sampling, wndLen] (const FastaRecord::Id& readId)
 	{
 		if (!readId.strand()) return;
-		auto minimizers = yieldMinimizers(_seqContainer.getSeq(readId), wndLen);
-		for (auto kmerPos : minimizers)
+		thread_local std::vector<CanonicalKmerPosition> minimizers;
+		yieldSampledKmers(_seqContainer.getSeq(readId), sampling, 
+						  wndLen, minimizers);
+		for (const auto& kmerPos : minimizers)
 		{
-			FastaRecord::Id targetRead = readId;
-			bool revCmp = kmerPos.kmer.standardForm();
-			if (revCmp)
-			{
-				kmerPos.position = _seqContainer.seqLen(readId) - 
-										kmerPos.position -
-										Parameters::get().kmerSize;
-				targetRead = targetRead.rc();
-			}
-
-			if (_repetitiveKmers.contains(kmerPos.kmer)) continue;
-
-			_kmerIndex.update_fn(kmerPos.kmer, 
-				[targetRead, &kmerPos, this](ReadVector& rv)
-				{
-					if (rv.size == rv.capacity) 
-					{
-						Logger::get().warning() << "Index size mismatch " << rv.capacity;
-						return;
-					}
-					size_t globPos = _seqContainer
-							.globalPosition(targetRead, kmerPos.position);
-					rv.data[rv.size].set(globPos);
-					++rv.size;
-				});
+			this->addIndexPosition(readId, kmerPos.kmer, 
+								   kmerPos.position, kmerPos.revComp);
 		}
 	};
 	processInParallel(allReads, indexUpdate, 
 					  Parameters::get().numThreads, _outputProgress);
 
-	Logger::get().debug() << "Sorting k-mer index";
-	for (const auto& kmerVec : _kmerIndex.lock_table())
-	{
-		std::sort(kmerVec.second.data, kmerVec.second.data + kmerVec.second.size,
-				  [](const IndexChunk& p1, const IndexChunk& p2)
-				  	{return p1.get() < p2.get();});
-	}
-	
-	size_t totalEntries = 0;
-	for (const auto& kmerRec : _kmerIndex.lock_table())
-	{
-		totalEntries += kmerRec.second.size;
-	}
-	Logger::get().debug() << "Selected k-mers: " << _kmerIndex.size();
+	this->finalizeIndex();
+	const size_t totalEntries = _indexPositions.size();
+	const size_t indexedKmers = _indexKmers.size() - _numRepetitive;
+	Logger::get().debug() << "Selected k-mers: " << indexedKmers;
 	Logger::get().debug() << "K-mer index size: " << totalEntries;
 	Logger::get().debug() << "Mean k-mer frequency: " 
-		<< (float)totalEntries / _kmerIndex.size();
+		<< (float)totalEntries / indexedKmers;
 
+	//expected distance between the sampled k-mers, used to calibrate
+	//the divergence estimates from the number of shared k-mers
 	float minimizerRate = (float)totalLen / totalEntries;
-	Logger::get().debug() << "Minimizer rate: " << minimizerRate;
+	Logger::get().debug() << "Sampling rate (" << samplingName(sampling) 
+		<< "): " << minimizerRate;
 	_sampleRate = minimizerRate;
 }
 
 
-void VertexIndex::clear()
+void VertexIndex::iterKmerPosBatch(const CanonicalKmerPosition* kmers, 
+								   size_t numKmers,
+								   std::vector<IterHelper>& outPositions,
+								   bool* outRepetitive) const
 {
-	for (auto& chunk : _memoryChunks) delete[] chunk;
-	_memoryChunks.clear();
+	assert(numKmers <= QUERY_BATCH);
+	outPositions.clear();
+	if (_view.numKmers == 0)
+	{
+		for (size_t i = 0; i < numKmers; ++i)
+		{
+			outRepetitive[i] = false;
+			outPositions.emplace_back(ReadVector(), kmers[i].revComp, 
+									  _seqContainer);
+		}
+		return;
+	}
+
+	size_t kmerIds[QUERY_BATCH];
+	for (size_t i = 0; i < numKmers; ++i)
+	{
+		kmerIds[i] = kmers[i].kmer.numRepr() >> _view.bucketShift;
+		__builtin_prefetch(_view.buckets + kmerIds[i]);
+	}
+	for (size_t i = 0; i < numKmers; ++i)
+	{
+		__builtin_prefetch(_view.kmers + _view.buckets[kmerIds[i]]);
+	}
+	for (size_t i = 0; i < numKmers; ++i)
+	{
+		const size_t bucket = kmerIds[i];
+		auto begin = _view.kmers + _view.buckets[bucket];
+		auto end = _view.kmers + _view.buckets[bucket + 1];
+		auto it = std::lower_bound(begin, end, kmers[i].kmer.numRepr());
+		if (it == end || *it != kmers[i].kmer.numRepr()) 
+		{
+			kmerIds[i] = NOT_FOUND;
+			continue;
+		}
+		kmerIds[i] = it - _view.kmers;
+		__builtin_prefetch(_view.offsets + kmerIds[i]);
+		__builtin_prefetch(_view.repetitive + kmerIds[i] / 64);
+	}
+	for (size_t i = 0; i < numKmers; ++i)
+	{
+		outRepetitive[i] = kmerIds[i] != NOT_FOUND && 
+						   this->isRepetitiveId(kmerIds[i]);
+		ReadVector rv = this->getReadVector(kmerIds[i]);
+		if (rv.size > 0) __builtin_prefetch(rv.data);
+		outPositions.emplace_back(rv, kmers[i].revComp, _seqContainer);
+	}
+}
 
+void VertexIndex::clear()
+{
 	_kmerIndex.clear();
 	_kmerIndex.reserve(0);
 
+	std::vector<Kmer::KmerRepr>().swap(_indexKmers);
+	std::vector<size_t>().swap(_indexOffsets);
+	std::vector<size_t>().swap(_kmerBuckets);
+	std::vector<IndexChunk>().swap(_indexPositions);
+	std::vector<uint64_t>().swap(_repetitiveFlags);
+	_numRepetitive = 0;
+	_fillCursors.reset();
+	this->updateIndexView();
+
 	_kmerCounter.clear();
 	//_kmerCounts.reserve(0);
 }
 
 
-void KmerCounter::count(bool useFlatCounter)
+namespace
 {
-	//Logger::get().debug() << "Before counter: " 
-	//	<< getPeakRSS() / 1024 / 1024 / 1024 << " Gb";
+	const char INDEX_MAGIC[8] = {'F', 'L', 'Y', 'E', 'K', 'I', 'D', 'X'};
+	const uint32_t INDEX_VERSION = 2;
+
+	//all sections except the last one (positions) have 8-byte
+	//elements, so they stay aligned in the mapped file
+	struct IndexHeader
+	{
+		char	 magic[8];
+		uint32_t version;
+		uint32_t kmerSize;
+		uint64_t sequencesHash;
+		uint64_t paramsHash;
+		uint64_t repetitiveFrequency;
+		double	 sampleRate;
+		uint64_t bucketShift;
+		uint64_t numKmers;
+		uint64_t numBuckets;
+		uint64_t numRepetitive;
+		uint64_t numPositions;
+		uint64_t kmersOffset;
+		uint64_t offsetsOffset;
+		uint64_t bucketsOffset;
+		uint64_t repetitiveOffset;
+		uint64_t positionsOffset;
+		uint64_t fileSize;
+	};
+	static_assert(sizeof(IndexHeader) % sizeof(uint64_t) == 0,
+				  "Unexpected size of IndexHeader structure");
+	static_assert(sizeof(size_t) == sizeof(uint64_t),
+				  "64-bit platform is required");
 
-	if (useFlatCounter && Parameters::get().kmerSize > 17)
+	uint64_t mixHash(uint64_t hash, uint64_t value)
 	{
-		throw std::runtime_error("Can't use flat counter for k-mer size > 17");
+		return hash ^ (value + 0x9E3779B97F4A7C15ULL + (hash << 6) + (hash >> 2));
 	}
-	_useFlatCounter = useFlatCounter;
 
-	//flat array for all possible k-mers, 4 bits for each
-	//in case of k=17, takes 8Gb
-	static const size_t COUNTER_LEN = std::pow(4, Parameters::get().kmerSize) / 2;
-	if (useFlatCounter)
+	uint64_t hashString(const std::string& str)
+	{
+		uint64_t hash = 0xcbf29ce484222325ULL;	//FNV-1a
+		for (char c : str) hash = (hash ^ (uint8_t)c) * 0x100000001b3ULL;
+		return hash;
+	}
+}
+
+//hash of the names and contents of the indexed sequences
+uint64_t VertexIndex::sequencesHash() const
+{
+	std::vector<FastaRecord::Id> forwardSeqs;
+	for (const auto& seq : _seqContainer.iterSeqs())
+	{
+		if (seq.id.strand()) forwardSeqs.push_back(seq.id);
+	}
+	std::vector<uint64_t> seqHashes(forwardSeqs.size());
+	std::vector<size_t> seqIds(forwardSeqs.size());
+	std::iota(seqIds.begin(), seqIds.end(), 0);
+	std::function<void(const size_t&)> hashSeq = 
+	[this, &forwardSeqs, &seqHashes] (const size_t& seqId)
+	{
+		const DnaSequence& seq = _seqContainer.getSeq(forwardSeqs[seqId]);
+		uint64_t hash = mixHash(hashString(_seqContainer.seqName(forwardSeqs[seqId])),
+								seq.length());
+		for (auto chunk : seq.packedChunks()) hash = mixHash(hash, chunk);
+		seqHashes[seqId] = hash;
+	};
+	processInParallel(seqIds, hashSeq, Parameters::get().numThreads, false);
+
+	uint64_t hash = forwardSeqs.size();
+	for (auto seqHash : seqHashes) hash = mixHash(hash, seqHash);
+	return hash;
+}
+
+void VertexIndex::save(const std::string& fileName, 
+					   const std::string& buildParams)
+{
+	IndexHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+	header.version = INDEX_VERSION;
+	header.kmerSize = Parameters::get().kmerSize;
+	header.sequencesHash = this->sequencesHash();
+	header.paramsHash = hashString(buildParams);
+	header.repetitiveFrequency = _repetitiveFrequency;
+	header.sampleRate = _sampleRate;
+	header.bucketShift = _view.bucketShift;
+	header.numKmers = _view.numKmers;
+	header.numBuckets = _view.numKmers > 0 ? 
+		(1ULL << (header.kmerSize * 2 - _view.bucketShift)) + 1 : 0;
+	header.numRepetitive = _numRepetitive;
+	header.numPositions = _view.numKmers > 0 ? _view.offsets[_view.numKmers] : 0;
+	header.kmersOffset = sizeof(IndexHeader);
+	header.offsetsOffset = header.kmersOffset + 
+						   header.numKmers * sizeof(Kmer::KmerRepr);
+	const size_t numOffsets = _view.numKmers > 0 ? header.numKmers + 1 : 0;
+	header.bucketsOffset = header.offsetsOffset + numOffsets * sizeof(uint64_t);
+	header.repetitiveOffset = header.bucketsOffset + 
+							  header.numBuckets * sizeof(uint64_t);
+	const size_t numFlagWords = _view.numKmers > 0 ? header.numKmers / 64 + 1 : 0;
+	header.positionsOffset = header.repetitiveOffset + 
+							 numFlagWords * sizeof(uint64_t);
+	header.fileSize = header.positionsOffset + 
+					  header.numPositions * sizeof(IndexChunk);
+
+	//written to a temporary file first, so the index that might be 
+	//currently mapped by another process is replaced atomically
+	const std::string tmpName = fileName + ".tmp";
+	FILE* fout = fopen(tmpName.c_str(), "wb");
+	if (!fout) throw std::runtime_error("Can't open " + tmpName);
+
+	fwrite(&header, sizeof(header), 1, fout);
+	fwrite(_view.kmers, sizeof(Kmer::KmerRepr), header.numKmers, fout);
+	fwrite(_view.offsets, sizeof(uint64_t), numOffsets, fout);
+	fwrite(_view.buckets, sizeof(uint64_t), header.numBuckets, fout);
+	fwrite(_view.repetitive, sizeof(uint64_t), numFlagWords, fout);
+	fwrite(_view.positions, sizeof(IndexChunk), header.numPositions, fout);
+
+	//buffered data is flushed on close, which might also fail
+	const bool writeFailed = ferror(fout);
+	if (fclose(fout) != 0 || writeFailed)
+	{
+		std::remove(tmpName.c_str());
+		throw std::runtime_error("Error writing " + tmpName);
+	}
+	if (rename(tmpName.c_str(), fileName.c_str()) != 0)
+	{
+		throw std::runtime_error("Error writing " + fileName);
+	}
+}
+
+bool VertexIndex::load(const std::string& fileName, 
+					   const std::string& buildParams)
+{
+	int fd = open(fileName.c_str(), O_RDONLY);
+	if (fd < 0) return false;
+
+	struct stat fileStat;
+	if (fstat(fd, &fileStat) != 0 || 
+		(size_t)fileStat.st_size < sizeof(IndexHeader))
+	{
+		close(fd);
+		Logger::get().warning() << "Truncated index file: " << fileName;
+		return false;
+	}
+	const size_t fileSize = fileStat.st_size;
+	void* mapped = mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapped == MAP_FAILED) 
+	{
+		Logger::get().warning() << "Can't map index file: " << fileName;
+		return false;
+	}
+	std::shared_ptr<const void> mapping(mapped, 
+		[fileSize](const void* ptr){munmap(const_cast<void*>(ptr), fileSize);});
+
+	const char* base = static_cast<const char*>(mapped);
+	const IndexHeader* header = reinterpret_cast<const IndexHeader*>(base);
+	if (memcmp(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) ||
+		header->version != INDEX_VERSION)
+	{
+		Logger::get().warning() << "Incompatible index file: " << fileName;
+		return false;
+	}
+	//section sizes are bounded by the file size first, so the 
+	//layout below can be computed without overflows
+	if (header->kmerSize > 32 || header->bucketShift > header->kmerSize * 2 ||
+		header->kmerSize * 2 - header->bucketShift >= 64 ||
+		header->numKmers > fileSize / sizeof(Kmer::KmerRepr) ||
+		header->numBuckets > fileSize / sizeof(uint64_t) ||
+		header->numPositions > fileSize / sizeof(IndexChunk))
+	{
+		Logger::get().warning() << "Corrupted index file: " << fileName;
+		return false;
+	}
+	const size_t numOffsets = header->numKmers > 0 ? header->numKmers + 1 : 0;
+	const size_t numFlagWords = header->numKmers > 0 ? header->numKmers / 64 + 1 : 0;
+	if (header->fileSize != fileSize ||
+		header->kmersOffset != sizeof(IndexHeader) ||
+		header->offsetsOffset != header->kmersOffset + 
+								 header->numKmers * sizeof(Kmer::KmerRepr) ||
+		header->bucketsOffset != header->offsetsOffset + 
+								 numOffsets * sizeof(uint64_t) ||
+		header->repetitiveOffset != header->bucketsOffset + 
+									header->numBuckets * sizeof(uint64_t) ||
+		header->positionsOffset != header->repetitiveOffset + 
+								   numFlagWords * sizeof(uint64_t) ||
+		header->fileSize != header->positionsOffset + 
+							header->numPositions * sizeof(IndexChunk) ||
+		(header->numKmers > 0 && header->numBuckets != 
+		 	(1ULL << (header->kmerSize * 2 - header->bucketShift)) + 1))
+	{
+		Logger::get().warning() << "Corrupted index file: " << fileName;
+		return false;
+	}
+
+	//lookups index k-mers through the buckets and positions through 
+	//the offsets: both must be monotonic and end at the section sizes
+	const size_t* buckets = reinterpret_cast<const size_t*>(base + header->bucketsOffset);
+	const size_t* offsets = reinterpret_cast<const size_t*>(base + header->offsetsOffset);
+	bool consistent = header->numKmers == 0 || 
+		(buckets[0] == 0 && buckets[header->numBuckets - 1] == header->numKmers &&
+		 offsets[0] == 0 && offsets[header->numKmers] == header->numPositions);
+	for (size_t i = 1; consistent && i < header->numBuckets; ++i)
+	{
+		if (buckets[i] < buckets[i - 1]) consistent = false;
+	}
+	for (size_t i = 1; consistent && i < numOffsets; ++i)
+	{
+		if (offsets[i] < offsets[i - 1]) consistent = false;
+	}
+	if (!consistent)
+	{
+		Logger::get().warning() << "Corrupted index file: " << fileName;
+		return false;
+	}
+
+	if (header->kmerSize != Parameters::get().kmerSize ||
+		header->paramsHash != hashString(buildParams) ||
+		header->sequencesHash != this->sequencesHash())
+	{
+		Logger::get().debug() << "Index file " << fileName 
+			<< " was built with different sequences or parameters";
+		return false;
+	}
+
+	this->clear();
+	_numRepetitive = header->numRepetitive;
+	_repetitiveFrequency = header->repetitiveFrequency;
+	_sampleRate = header->sampleRate;
+
+	if (header->numKmers > 0)
+	{
+		_view.kmers = reinterpret_cast<const Kmer::KmerRepr*>(base + header->kmersOffset);
+		_view.offsets = reinterpret_cast<const size_t*>(base + header->offsetsOffset);
+		_view.buckets = reinterpret_cast<const size_t*>(base + header->bucketsOffset);
+		_view.positions = reinterpret_cast<const IndexChunk*>(base + header->positionsOffset);
+		_view.repetitive = reinterpret_cast<const uint64_t*>(base + header->repetitiveOffset);
+		_view.numKmers = header->numKmers;
+		_view.bucketShift = header->bucketShift;
+		_mappedIndex = mapping;
+	}
+	Logger::get().debug() << "Loaded " << header->numKmers << " k-mers, "
+		<< header->numPositions << " positions from " << fileName;
+	return true;
+}
+
+void VertexIndex::buildCached(const std::string& indexName, 
+							  const std::string& buildParams,
+							  const std::function<void()>& buildFun)
+{
+	const std::string& cacheDir = Parameters::get().indexCacheDir;
+	//repetitive k-mer filtering and sampling are a part of every index build
+	const std::string params = buildParams + " repeat_kmer_rate=" + 
+							   std::to_string((float)Config::get("repeat_kmer_rate")) +
+							   " kmer_sampling=" + 
+							   std::to_string((int)Config::get("kmer_sampling"));
+	const std::string fileName = cacheDir + "/" + indexName + ".idx";
+	if (!cacheDir.empty() && this->load(fileName, params)) 
+	{
+		if (_outputProgress) Logger::get().info() << "Loaded index from " << fileName;
+		return;
+	}
+
+	buildFun();
+	if (!cacheDir.empty())
+	{
+		Logger::get().debug() << "Saving index to " << fileName;
+		this->save(fileName, params);
+	}
+}
+
+void KmerCounter::count()
+{
+	const size_t kmerSize = Parameters::get().kmerSize;
+	const size_t flatBytes = kmerSize <= MAX_FLAT_KMER ? 
+							 std::pow(4, kmerSize) / 2 : 0;
+	if (kmerSize <= MAX_FLAT_KMER &&
+		(_memoryBudget == 0 || flatBytes <= _memoryBudget / 2))
+	{
+		Logger::get().debug() << "Counting k-mers using flat array";
+		this->countFlat();
+		return;
+	}
+
+	//a quarter of the budget (or of the free memory, if there is no 
+	//budget) is given to the in-memory pass buffer. If too many passes 
+	//are needed, temporary files are used instead
+	size_t totalKmers = 0;
+	for (const auto& seq : _seqContainer.iterSeqs())
+	{
+		if (seq.id.strand() && seq.sequence.length() > kmerSize)
+		{
+			totalKmers += seq.sequence.length() - kmerSize;
+		}
+	}
+	size_t maxPassKmers = std::max((size_t)MIN_PASS_KMERS, 
+						getFreeMemorySize() / 4 / sizeof(Kmer::KmerRepr));
+	if (_memoryBudget > 0)
+	{
+		maxPassKmers = std::max((size_t)1, 
+							_memoryBudget / 4 / sizeof(Kmer::KmerRepr));
+	}
+	_storeSingletons = !(bool)Config::get("kmer_singleton_filter");
+	if (totalKmers / maxPassKmers + 1 > MAX_MEMORY_PASSES && !_tempDir.empty())
+	{
+		Logger::get().debug() << "Counting k-mers using temporary files";
+		this->countExternal(totalKmers);
+	}
+	else
+	{
+		Logger::get().debug() << "Counting k-mers in memory";
+		if (!this->countPartitioned(maxPassKmers))
+		{
+			Logger::get().info() << "K-mer counting passes do not fit into "
+				"the memory budget, using temporary files";
+			this->countExternal(totalKmers);
+		}
+	}
+
+	Logger::get().debug() << "Updating k-mer histogram";
+	size_t tableSize = 0;
+	for (const auto& partition : _partitions)
+	{
+		for (auto count : partition.counts) _kmerDistribution[count] += 1;
+		tableSize += partition.kmers.size() * 
+					 (sizeof(Kmer::KmerRepr) + sizeof(uint32_t));
+	}
+	if (_numSingletons > 0) _kmerDistribution[1] += _numSingletons;
+	Logger::get().debug() << "K-mer table size: " 
+		<< tableSize / 1024 / 1024 << " Mb";
+	if (_memoryBudget > 0 && tableSize > _memoryBudget)
 	{
-		_flatCounter = new std::atomic<uint8_t>[COUNTER_LEN];
-		std::memset(_flatCounter, 0, COUNTER_LEN);
+		Logger::get().warning() << "K-mer table does not fit into the memory budget";
 	}
+	Logger::get().debug() << "Total k-mers " << _numKmers;
+}
+
+void KmerCounter::countFlat()
+{
+	//Logger::get().debug() << "Before counter: " 
+	//	<< getPeakRSS() / 1024 / 1024 / 1024 << " Gb";
+
+	_useFlatCounter = true;
+
+	//flat array for all possible k-mers, 4 bits for each
+	//in case of k=17, takes 8Gb
+	const size_t COUNTER_LEN = std::pow(4, Parameters::get().kmerSize) / 2;
+	_flatCounter = new std::atomic<uint8_t>[COUNTER_LEN];
+	std::memset(_flatCounter, 0, COUNTER_LEN);
  
 	if (_outputProgress) Logger::get().info() << "Counting k-mers:";
 	std::function<void(const FastaRecord::Id&)> readUpdate = 
@@ -386,37 +898,26 @@ void KmerCounter::count(bool useFlatCounter)
 	{
 		if (!readId.strand()) return;
 		
-		for (auto kmerPos : IterKmers(_seqContainer.getSeq(readId)))
+		for (const auto& kmerPos : IterCanonicalKmers(_seqContainer.getSeq(readId)))
 		{
-			kmerPos.kmer.standardForm();
-			bool addOne = true;
-			if (_useFlatCounter)
-			{
-				size_t arrayPos = kmerPos.kmer.numRepr() / 2;
-				bool highBits = kmerPos.kmer.numRepr() % 2;
+			size_t arrayPos = kmerPos.kmer.numRepr() / 2;
+			bool highBits = kmerPos.kmer.numRepr() % 2;
 
-				while (true)
+			while (true)
+			{
+				uint8_t expected = _flatCounter[arrayPos]; 
+				uint8_t count = highBits ? (expected >> 4) : (expected & 15);
+				if (count == 15)
 				{
-					uint8_t expected = _flatCounter[arrayPos]; 
-					uint8_t count = highBits ? (expected >> 4) : (expected & 15);
-					if (count == 15)
-					{
-						break;
-					}
-
-					uint8_t updated = highBits ? (expected + 16) : (expected + 1);
-					if (_flatCounter[arrayPos].compare_exchange_weak(expected,  updated))
-					{
-						if (count == 0) ++_numKmers;
-						addOne = false; //not saturated yet, don't update hash counter
-						break;
-					}
+					break;	//saturated, will be counted separately
 				}
-			}
 
-			if (addOne)
-			{
-				_hashCounter.upsert(kmerPos.kmer, [](size_t& num){++num;}, 1);
+				uint8_t updated = highBits ? (expected + 16) : (expected + 1);
+				if (_flatCounter[arrayPos].compare_exchange_weak(expected,  updated))
+				{
+					if (count == 0) ++_numKmers;
+					break;
+				}
 			}
 		}
 	};
@@ -427,71 +928,598 @@ void KmerCounter::count(bool useFlatCounter)
 	}
 	processInParallel(allReads, readUpdate, Parameters::get().numThreads, _outputProgress);
 
+	//the flat array is scanned in cache-sized blocks in parallel. Each block
+	//gets a local histogram of the unsaturated counts, and the sorted
+	//list of saturated k-mers
 	Logger::get().debug() << "Updating k-mer histogram";
-	if (_useFlatCounter)
+	const size_t numBlocks = (COUNTER_LEN + HIST_BLOCK_BYTES - 1) / HIST_BLOCK_BYTES;
+	std::vector<std::vector<Kmer::KmerRepr>> blockSaturated(numBlocks);
+	std::vector<size_t> flatHist(16, 0);
+	std::mutex histMutex;
+	std::function<void(const size_t&)> scanBlock = 
+	[this, COUNTER_LEN, &blockSaturated, &flatHist, &histMutex] 
+	(const size_t& blockId)
 	{
-		for (size_t kmerId = 0; kmerId < COUNTER_LEN * 2; ++kmerId)
+		size_t localHist[16] = {0};
+		const size_t blockStart = blockId * HIST_BLOCK_BYTES;
+		const size_t blockEnd = std::min(COUNTER_LEN, blockStart + HIST_BLOCK_BYTES);
+		for (size_t pos = blockStart; pos < blockEnd; pos += sizeof(uint64_t))
 		{
-			Kmer kmer(kmerId);
-			size_t freq = this->getFreq(kmer);
-			if (freq > 0) _kmerDistribution[freq] += 1;
-			//if (kmerId % 1000000 == 0) Logger::get().debug() << kmerId << " " << freq;
+			uint64_t word = 0;
+			std::memcpy(&word, _flatCounter + pos, 
+						std::min(sizeof(uint64_t), blockEnd - pos));
+			if (!word) continue;
+
+			for (size_t i = 0; i < 16; ++i) ++localHist[(word >> (i * 4)) & 15];
+			//lowest bit of each nibble that equals 15
+			uint64_t saturated = word & (word >> 1) & (word >> 2) & (word >> 3) & 
+								 0x1111111111111111ULL;
+			while (saturated)
+			{
+				blockSaturated[blockId].push_back(pos * 2 + 
+												  __builtin_ctzll(saturated) / 4);
+				saturated &= saturated - 1;
+			}
 		}
+		std::lock_guard<std::mutex> lock(histMutex);
+		for (size_t i = 0; i < 16; ++i) flatHist[i] += localHist[i];
+	};
+	std::vector<size_t> blockIds(numBlocks);
+	std::iota(blockIds.begin(), blockIds.end(), 0);
+	processInParallel(blockIds, scanBlock, Parameters::get().numThreads, false);
+
+	_saturatedKmers.clear();
+	for (auto& block : blockSaturated)
+	{
+		_saturatedKmers.insert(_saturatedKmers.end(), block.begin(), block.end());
+		std::vector<Kmer::KmerRepr>().swap(block);
 	}
-	else
+	this->countSaturated();
+
+	for (size_t freq = 1; freq < 15; ++freq)
 	{
-		for (const auto& kmer : _hashCounter.lock_table())
-		{
-			_kmerDistribution[kmer.second] += 1;
-		}
+		if (flatHist[freq] > 0) _kmerDistribution[freq] += flatHist[freq];
+	}
+	for (size_t i = 0; i < _saturatedKmers.size(); ++i)
+	{
+		_kmerDistribution[_saturatedCounts[i]] += 1;
 	}
 
 	//Logger::get().debug() << "After counter: " 
 	//	<< getPeakRSS() / 1024 / 1024 / 1024 << " Gb";
 
-	Logger::get().debug() << "Hash size: " << _hashCounter.size();
+	Logger::get().debug() << "Saturated k-mers: " << _saturatedKmers.size();
 	Logger::get().debug() << "Total k-mers " << _numKmers;
 }
 
+//K-mers that saturated the 4-bit flat counter (already collected
+//from the flat array in sorted order) are indexed, then all their
+//occurrences are counted in a second pass over the reads
+void KmerCounter::countSaturated()
+{
+	const size_t kmerBits = Parameters::get().kmerSize * 2;
+	_saturatedShift = kmerBits > SATURATED_BUCKET_BITS ? 
+					  kmerBits - SATURATED_BUCKET_BITS : 0;
+	if (_saturatedKmers.empty()) return;
 
-size_t KmerCounter::getFreq(Kmer kmer) const
+	_saturatedBuckets.assign((1ULL << SATURATED_BUCKET_BITS) + 1, 0);
+	for (auto kmer : _saturatedKmers) 
+	{
+		++_saturatedBuckets[(kmer >> _saturatedShift) + 1];
+	}
+	for (size_t i = 1; i < _saturatedBuckets.size(); ++i)
+	{
+		_saturatedBuckets[i] += _saturatedBuckets[i - 1];
+	}
+	_saturatedCounts.reset(new std::atomic<uint32_t>[_saturatedKmers.size()]);
+	for (size_t i = 0; i < _saturatedKmers.size(); ++i) _saturatedCounts[i] = 0;
+
+	std::function<void(const FastaRecord::Id&)> readUpdate = 
+	[this] (const FastaRecord::Id& readId)
+	{
+		if (!readId.strand()) return;
+		
+		for (const auto& kmerPos : IterCanonicalKmers(_seqContainer.getSeq(readId)))
+		{
+			const size_t repr = kmerPos.kmer.numRepr();
+			const uint8_t counts = _flatCounter[repr / 2];
+			if ((repr % 2 ? counts >> 4 : counts & 15) < 15) continue;
+
+			const size_t bucket = repr >> _saturatedShift;
+			auto it = std::lower_bound(_saturatedKmers.begin() + 
+									   _saturatedBuckets[bucket],
+									   _saturatedKmers.begin() + 
+									   _saturatedBuckets[bucket + 1], repr);
+			_saturatedCounts[it - _saturatedKmers.begin()]
+				.fetch_add(1, std::memory_order_relaxed);
+		}
+	};
+	std::vector<FastaRecord::Id> allReads;
+	for (const auto& seq : _seqContainer.iterSeqs())
+	{
+		allReads.push_back(seq.id);
+	}
+	processInParallel(allReads, readUpdate, Parameters::get().numThreads, false);
+}
+
+size_t KmerCounter::saturatedFreq(Kmer kmer) const
 {
-	//kmer.standardForm();
+	if (_saturatedKmers.empty()) return 0;
+
+	const size_t bucket = kmer.numRepr() >> _saturatedShift;
+	auto begin = _saturatedKmers.begin() + _saturatedBuckets[bucket];
+	auto end = _saturatedKmers.begin() + _saturatedBuckets[bucket + 1];
+	auto it = std::lower_bound(begin, end, kmer.numRepr());
+	if (it == end || *it != kmer.numRepr()) return 0;
+	return _saturatedCounts[it - _saturatedKmers.begin()];
+}
+
+void KmerCounter::countPartition(Kmer::KmerRepr* begin, Kmer::KmerRepr* end,
+								 CountedPartition& partition)
+{
+	std::sort(begin, end);
 
-	size_t addCount = 0;
-	if (_useFlatCounter)
+	//singletons are counted, but might not be stored
+	const size_t minStored = _storeSingletons ? 1 : 2;
+	size_t numUnique = 0;
+	size_t numStored = 0;
+	for (auto it = begin; it != end; )
 	{
-		size_t arrayPos = kmer.numRepr() / 2;
-		bool highBits = kmer.numRepr() % 2;
-		uint8_t count = highBits ? (_flatCounter[arrayPos]) >> 4 : (_flatCounter[arrayPos] & 15);
-		if (count < 15) 
+		auto runEnd = it;
+		while (runEnd != end && *runEnd == *it) ++runEnd;
+		++numUnique;
+		if ((size_t)(runEnd - it) >= minStored) ++numStored;
+		it = runEnd;
+	}
+	partition.kmers.reserve(numStored);
+	partition.counts.reserve(numStored);
+	for (auto it = begin; it != end; )
+	{
+		auto runEnd = it;
+		while (runEnd != end && *runEnd == *it) ++runEnd;
+		if ((size_t)(runEnd - it) >= minStored)
 		{
-			return count;
+			partition.kmers.push_back(*it);
+			partition.counts.push_back(runEnd - it);
 		}
-		else
+		it = runEnd;
+	}
+	_numKmers += numUnique;
+	_numSingletons += numUnique - numStored;
+}
+
+//The filter takes a separate pass over the reads. Returns the total
+//number of k-mer occurrences. If there are too many distinct k-mers
+//for the filter size, most of the singletons pass it, and the filter
+//is dropped: it would only slow down the counting passes
+size_t KmerCounter::buildSingletonFilter(const std::vector<FastaRecord::Id>& reads)
+{
+	const size_t kmerSize = Parameters::get().kmerSize;
+	size_t totalKmers = 0;
+	for (const auto& readId : reads)
+	{
+		const size_t readLen = _seqContainer.seqLen(readId);
+		if (readLen > kmerSize) totalKmers += readLen - kmerSize;
+	}
+
+	//16-32 bits per k-mer occurrence, or a quarter of the budget
+	//(of the free memory, if there is no budget)
+	const size_t memoryLimit = _memoryBudget > 0 ? _memoryBudget : 
+													getFreeMemorySize();
+	const size_t numWords = std::min(totalKmers / 2 + 1, 
+				std::max((size_t)1, memoryLimit / 4 / sizeof(uint64_t)));
+	_singletonFilter.reset(new RepeatedKmerFilter(numWords));
+	Logger::get().debug() << "Singleton filter size: " 
+		<< _singletonFilter->memoryUsage() / 1024 / 1024 << " Mb";
+
+	std::atomic<size_t> numOccurrences(0);
+	std::function<void(const FastaRecord::Id&)> fillFilter = 
+	[this, &numOccurrences] (const FastaRecord::Id& readId)
+	{
+		size_t readKmers = 0;
+		for (const auto& kmerPos : IterCanonicalKmers(_seqContainer.getSeq(readId)))
+		{
+			_singletonFilter->insert(kmerPos.kmer);
+			++readKmers;
+		}
+		numOccurrences += readKmers;
+	};
+	//the filter only gets more saturated with more reads, so 
+	//oversubscription is usually detected after a small prefix
+	const double MAX_PASS_RATE = 0.5;
+	const size_t probeReads = reads.size() / FILTER_PROBE_FRACTION;
+	std::vector<FastaRecord::Id> 
+		probeSet(reads.begin(), reads.begin() + probeReads);
+	std::vector<FastaRecord::Id> 
+		restSet(reads.begin() + probeReads, reads.end());
+	for (auto readSet : {&probeSet, &restSet})
+	{
+		processInParallel(*readSet, fillFilter, Parameters::get().numThreads, 
+						  _outputProgress && readSet == &restSet);
+		const double passRate = _singletonFilter->singletonPassRate();
+		if (passRate > MAX_PASS_RATE)
 		{
-			addCount = count;
+			Logger::get().info() << "Singleton k-mer filter is oversubscribed ("
+				<< (int)(passRate * 100) << "% of singletons pass), "
+				<< "counting without it";
+			_singletonFilter.reset();
+			break;
 		}
 	}
+	return numOccurrences;
+}
+
+//k-mer occurrences that did not pass the filter all belong to singletons
+void KmerCounter::releaseSingletonFilter(size_t totalKmers, size_t passedKmers)
+{
+	_singletonFilter.reset();
+	_numKmers += totalKmers - passedKmers;
+	_numSingletons += totalKmers - passedKmers;
+	Logger::get().debug() << "Singleton filter passed " << passedKmers 
+		<< " k-mer occurrences out of " << totalKmers;
+}
+
+bool KmerCounter::countPartitioned(size_t maxPassKmers)
+{
+	_useFlatCounter = false;
+	const size_t NUM_PARTITIONS = 1ULL << PARTITION_BITS;
+	std::vector<FastaRecord::Id> forwardReads;
+	for (const auto& seq : _seqContainer.iterSeqs())
+	{
+		if (seq.id.strand()) forwardReads.push_back(seq.id);
+	}
+
+	if (_outputProgress) Logger::get().info() << "Counting k-mers:";
+	size_t totalKmers = 0;
+	if (!_storeSingletons) totalKmers = this->buildSingletonFilter(forwardReads);
+
+	//the number of k-mer occurrences in each partition
+	std::vector<size_t> partitionSizes(NUM_PARTITIONS, 0);
+	std::mutex sizesMutex;
+	std::function<void(const FastaRecord::Id&)> sizeUpdate = 
+	[this, &partitionSizes, &sizesMutex] (const FastaRecord::Id& readId)
+	{
+		thread_local std::vector<size_t> localSizes;
+		localSizes.assign(NUM_PARTITIONS, 0);
+		for (const auto& kmerPos : IterCanonicalKmers(_seqContainer.getSeq(readId)))
+		{
+			if (this->passesFilter(kmerPos.kmer)) 
+			{
+				++localSizes[partitionId(kmerPos.kmer)];
+			}
+		}
+		std::lock_guard<std::mutex> lock(sizesMutex);
+		for (size_t i = 0; i < NUM_PARTITIONS; ++i) 
+		{
+			partitionSizes[i] += localSizes[i];
+		}
+	};
+	processInParallel(forwardReads, sizeUpdate, Parameters::get().numThreads, 
+					  _outputProgress && !_singletonFilter);
+
+	//consecutive partitions are grouped into passes. The number of
+	//passes is bounded (each of them is a full scan over the reads):
+	//if the buffer is too small for that, it is enlarged. An explicit
+	//budget is never exceeded: temporary files are used instead
+	const size_t passedKmers = std::accumulate(partitionSizes.begin(), 
+								partitionSizes.end(), (size_t)0);
+	const size_t minPassKmers = passedKmers / MAX_MEMORY_PASSES + 
+		*std::max_element(partitionSizes.begin(), partitionSizes.end());
+	if (maxPassKmers < minPassKmers)
+	{
+		const size_t minPassMb = minPassKmers * sizeof(Kmer::KmerRepr) / 
+								 1024 / 1024;
+		if (_memoryBudget > 0)
+		{
+			if (_tempDir.empty())
+			{
+				throw std::runtime_error("K-mer counting needs a pass buffer of " +
+					std::to_string(minPassMb) + " Mb, which does not fit into "
+					"the memory budget, and no temporary directory is set");
+			}
+			_singletonFilter.reset();
+			return false;
+		}
+		Logger::get().debug() << "Increasing k-mer pass buffer to " 
+			<< minPassMb << " Mb";
+		maxPassKmers = minPassKmers;
+	}
+	std::vector<size_t> passStarts = {0};
+	size_t passKmers = 0;
+	for (size_t i = 0; i < NUM_PARTITIONS; ++i)
+	{
+		if (passKmers > 0 && passKmers + partitionSizes[i] > maxPassKmers)
+		{
+			passStarts.push_back(i);
+			passKmers = 0;
+		}
+		passKmers += partitionSizes[i];
+	}
+	passStarts.push_back(NUM_PARTITIONS);
+	Logger::get().debug() << "Counting k-mers in " << passStarts.size() - 1
+		<< " pass(es)";
+
+	_partitions.assign(NUM_PARTITIONS, CountedPartition());
+	for (size_t pass = 0; pass + 1 < passStarts.size(); ++pass)
+	{
+		const size_t firstPart = passStarts[pass];
+		const size_t lastPart = passStarts[pass + 1];
+
+		//partitions of the pass are laid out consecutively in the buffer.
+		//Each read reserves its ranges with one atomic add per partition
+		std::vector<size_t> partOffsets(lastPart - firstPart + 1, 0);
+		for (size_t i = firstPart; i < lastPart; ++i)
+		{
+			partOffsets[i - firstPart + 1] = partOffsets[i - firstPart] + 
+											 partitionSizes[i];
+		}
+		std::vector<Kmer::KmerRepr> buffer(partOffsets.back());
+		std::unique_ptr<std::atomic<size_t>[]> 
+			cursors(new std::atomic<size_t>[lastPart - firstPart]);
+		for (size_t i = 0; i < lastPart - firstPart; ++i) 
+		{
+			cursors[i] = partOffsets[i];
+		}
+
+		std::function<void(const FastaRecord::Id&)> fillBuffer = 
+		[this, firstPart, lastPart, &buffer, &cursors] 
+		(const FastaRecord::Id& readId)
+		{
+			thread_local std::vector<std::pair<size_t, Kmer::KmerRepr>> readKmers;
+			thread_local std::vector<size_t> localPos;
+			readKmers.clear();
+			localPos.assign(lastPart - firstPart, 0);
+			for (const auto& kmerPos : 
+				 IterCanonicalKmers(_seqContainer.getSeq(readId)))
+			{
+				const size_t partId = partitionId(kmerPos.kmer);
+				if (partId < firstPart || partId >= lastPart ||
+					!this->passesFilter(kmerPos.kmer)) continue;
+				readKmers.emplace_back(partId - firstPart, 
+									   kmerPos.kmer.numRepr());
+				++localPos[partId - firstPart];
+			}
+			for (size_t i = 0; i < localPos.size(); ++i)
+			{
+				if (localPos[i] > 0) localPos[i] = cursors[i].fetch_add(localPos[i]);
+			}
+			for (const auto& partKmer : readKmers)
+			{
+				buffer[localPos[partKmer.first]++] = partKmer.second;
+			}
+		};
+		processInParallel(forwardReads, fillBuffer, 
+						  Parameters::get().numThreads, false);
+
+		std::vector<size_t> passPartitions;
+		for (size_t i = firstPart; i < lastPart; ++i) passPartitions.push_back(i);
+		std::function<void(const size_t&)> countPart = 
+		[this, firstPart, &buffer, &partOffsets] (const size_t& partId)
+		{
+			this->countPartition(buffer.data() + partOffsets[partId - firstPart],
+								 buffer.data() + partOffsets[partId - firstPart + 1],
+								 _partitions[partId]);
+		};
+		processInParallel(passPartitions, countPart, 
+						  Parameters::get().numThreads, false);
+	}
+
+	if (_singletonFilter) this->releaseSingletonFilter(totalKmers, passedKmers);
+	return true;
+}
+
+namespace
+{
+	//temporary files that are removed on destruction
+	struct TempFiles
+	{
+		~TempFiles()
+		{
+			for (size_t i = 0; i < files.size(); ++i)
+			{
+				fclose(files[i]);
+				std::remove(names[i].c_str());
+			}
+		}
+		std::vector<std::string> names;
+		std::vector<FILE*> files;
+	};
+}
+
+//Disk-backed partitioned counting: a single pass over the reads writes
+//the k-mers into temporary files (each holds a group of partitions),
+//then the files are loaded one by one, split into the partitions, 
+//which are sorted and counted. The number of files is chosen so that
+//a file takes a quarter of the budget (or of the free memory, if 
+//there is no budget) at most
+void KmerCounter::countExternal(size_t expectedKmers)
+{
+	_useFlatCounter = false;
+	const size_t NUM_PARTITIONS = 1ULL << PARTITION_BITS;
+	const size_t memoryLimit = _memoryBudget > 0 ? _memoryBudget : 
+													getFreeMemorySize();
+	const size_t maxFileKmers = std::max((size_t)1, 
+							memoryLimit / 4 / sizeof(Kmer::KmerRepr));
+	size_t fileBits = MIN_FILE_BITS;
+	while (fileBits < PARTITION_BITS && 
+		   expectedKmers >> fileBits > maxFileKmers) ++fileBits;
+	const size_t NUM_FILES = 1ULL << fileBits;
+	const size_t SUBPART_BITS = PARTITION_BITS - fileBits;
+	Logger::get().debug() << "Counting k-mers in " << NUM_FILES 
+		<< " temporary files";
+
+	TempFiles tempFiles;
+	for (size_t i = 0; i < NUM_FILES; ++i)
+	{
+		std::string fileName = _tempDir + "/kmers_" + std::to_string(i) + ".tmp";
+		FILE* file = fopen(fileName.c_str(), "w+b");
+		if (!file) throw std::runtime_error("Can't open " + fileName);
+		tempFiles.names.push_back(fileName);
+		tempFiles.files.push_back(file);
+	}
+
+	std::vector<FastaRecord::Id> forwardReads;
+	for (const auto& seq : _seqContainer.iterSeqs())
+	{
+		if (seq.id.strand()) forwardReads.push_back(seq.id);
+	}
+
+	if (_outputProgress) Logger::get().info() << "Counting k-mers:";
+	size_t totalKmers = 0;
+	if (!_storeSingletons) totalKmers = this->buildSingletonFilter(forwardReads);
+
+	//k-mers of each read are grouped by file, then appended
+	//to the files under the file locks
+	std::vector<std::mutex> fileMutexes(NUM_FILES);
+	std::vector<size_t> fileSizes(NUM_FILES, 0);
+	std::atomic<bool> writeFailed(false);
+	std::function<void(const FastaRecord::Id&)> writeKmers = 
+	[this, NUM_FILES, SUBPART_BITS, &tempFiles, &fileMutexes, &fileSizes, 
+	 &writeFailed] (const FastaRecord::Id& readId)
+	{
+		thread_local std::vector<std::pair<size_t, Kmer::KmerRepr>> readKmers;
+		thread_local std::vector<Kmer::KmerRepr> grouped;
+		thread_local std::vector<size_t> fileOffsets;
+		readKmers.clear();
+		fileOffsets.assign(NUM_FILES + 1, 0);
+		for (const auto& kmerPos : IterCanonicalKmers(_seqContainer.getSeq(readId)))
+		{
+			if (!this->passesFilter(kmerPos.kmer)) continue;
+			const size_t fileId = partitionId(kmerPos.kmer) >> SUBPART_BITS;
+			readKmers.emplace_back(fileId, kmerPos.kmer.numRepr());
+			++fileOffsets[fileId + 1];
+		}
+		for (size_t i = 0; i < NUM_FILES; ++i) fileOffsets[i + 1] += fileOffsets[i];
+		grouped.resize(readKmers.size());
+		for (const auto& fileKmer : readKmers)
+		{
+			grouped[fileOffsets[fileKmer.first]++] = fileKmer.second;
+		}
+
+		size_t groupStart = 0;
+		for (size_t i = 0; i < NUM_FILES; ++i)
+		{
+			const size_t groupSize = fileOffsets[i] - groupStart;
+			if (groupSize == 0) continue;
+
+			std::lock_guard<std::mutex> lock(fileMutexes[i]);
+			if (fwrite(grouped.data() + groupStart, sizeof(Kmer::KmerRepr), 
+					   groupSize, tempFiles.files[i]) != groupSize)
+			{
+				writeFailed = true;
+			}
+			fileSizes[i] += groupSize;
+			groupStart = fileOffsets[i];
+		}
+	};
+	processInParallel(forwardReads, writeKmers, Parameters::get().numThreads, 
+					  _outputProgress && !_singletonFilter);
+	if (writeFailed) throw std::runtime_error("Error writing temporary k-mer file");
+	if (_singletonFilter)
+	{
+		this->releaseSingletonFilter(totalKmers, 
+				std::accumulate(fileSizes.begin(), fileSizes.end(), (size_t)0));
+	}
+
+	//files are processed in parallel, as long as they fit into the
+	//budget (or the free memory). Very frequent k-mers can not be split 
+	//between the files, so a file could still be larger than expected
+	const size_t maxFileBytes = *std::max_element(fileSizes.begin(), fileSizes.end()) *
+								sizeof(Kmer::KmerRepr);
+	if (maxFileBytes > memoryLimit / 4)
+	{
+		Logger::get().warning() << "Temporary k-mer file of " 
+			<< maxFileBytes / 1024 / 1024 << " Mb exceeds the memory limit of " 
+			<< memoryLimit / 4 / 1024 / 1024 << " Mb per file";
+	}
+	const size_t numThreads = std::max((size_t)1, 
+						std::min((size_t)Parameters::get().numThreads, 
+								 memoryLimit / 4 / std::max(maxFileBytes, (size_t)1)));
+	Logger::get().debug() << "Loading temporary k-mer files in " 
+		<< numThreads << " thread(s)";
+
+	_partitions.assign(NUM_PARTITIONS, CountedPartition());
+	std::atomic<bool> readFailed(false);
+	std::vector<size_t> fileIds;
+	for (size_t i = 0; i < NUM_FILES; ++i) fileIds.push_back(i);
+	std::function<void(const size_t&)> countFile = 
+	[this, SUBPART_BITS, &tempFiles, &fileSizes, &readFailed] 
+	(const size_t& fileId)
+	{
+		std::vector<Kmer::KmerRepr> kmers(fileSizes[fileId]);
+		FILE* file = tempFiles.files[fileId];
+		if (fseek(file, 0, SEEK_SET) != 0 ||
+			fread(kmers.data(), sizeof(Kmer::KmerRepr), 
+				  kmers.size(), file) != kmers.size())
+		{
+			readFailed = true;
+			return;
+		}
+
+		//split into partitions by the lower bits of the partition id
+		std::vector<size_t> bounds = {0, kmers.size()};
+		for (size_t bit = SUBPART_BITS; bit-- > 0; )
+		{
+			std::vector<size_t> newBounds = {0};
+			for (size_t i = 0; i + 1 < bounds.size(); ++i)
+			{
+				auto mid = std::partition(kmers.begin() + bounds[i], 
+										  kmers.begin() + bounds[i + 1],
+										  [bit](Kmer::KmerRepr kmer)
+										  {return !((partitionId(Kmer(kmer)) >> bit) & 1);});
+				newBounds.push_back(mid - kmers.begin());
+				newBounds.push_back(bounds[i + 1]);
+			}
+			bounds.swap(newBounds);
+		}
+		for (size_t i = 0; i + 1 < bounds.size(); ++i)
+		{
+			this->countPartition(kmers.data() + bounds[i], 
+								 kmers.data() + bounds[i + 1],
+								 _partitions[(fileId << SUBPART_BITS) + i]);
+		}
+	};
+	processInParallel(fileIds, countFile, numThreads, false);
+	if (readFailed) throw std::runtime_error("Error reading temporary k-mer file");
+}
+
+size_t KmerCounter::getFreq(Kmer kmer) const
+{
+	//kmer.standardForm();
+
+	if (!_useFlatCounter)
+	{
+		const CountedPartition& partition = _partitions[partitionId(kmer)];
+		auto it = std::lower_bound(partition.kmers.begin(), 
+								   partition.kmers.end(), kmer.numRepr());
+		if (it == partition.kmers.end() || *it != kmer.numRepr()) return 0;
+		return partition.counts[it - partition.kmers.begin()];
+	}
 
-	size_t freq = 0;
-	_hashCounter.find(kmer, freq);
-	return freq + addCount;
+	size_t arrayPos = kmer.numRepr() / 2;
+	bool highBits = kmer.numRepr() % 2;
+	uint8_t count = highBits ? (_flatCounter[arrayPos]) >> 4 : (_flatCounter[arrayPos] & 15);
+	if (count < 15) return count;
+	return this->saturatedFreq(kmer);
 }
 
 void KmerCounter::clear()
 {
-	_hashCounter.clear();
-	_hashCounter.reserve(0);
+	_partitions.clear();
+	_partitions.shrink_to_fit();
 	if (_flatCounter)
 	{
 		delete[] _flatCounter;
 		_flatCounter = nullptr;
 	}
+	_saturatedKmers.clear();
+	_saturatedKmers.shrink_to_fit();
+	_saturatedBuckets.clear();
+	_saturatedBuckets.shrink_to_fit();
+	_saturatedCounts.reset();
 }
 
 size_t KmerCounter::getKmerNum() const
 {
-	if (!_useFlatCounter) return _hashCounter.size();
 	return _numKmers;
 }
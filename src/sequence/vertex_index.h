@@ -11,10 +11,15 @@
 #include <vector>
 #include <iostream>
 #include <cstring>
+#include <mutex>
+#include <functional>
+#include <memory>
+#include <algorithm>
 
 #include <cuckoohash_map.hh>
 
 #include "kmer.h"
+#include "kmer_filter.h"
 #include "sequence_container.h"
 #include "../common/config.h"
 #include "../common/logger.h"
@@ -26,17 +31,15 @@ class KmerCounter
 {
 public:
 	KmerCounter(const SequenceContainer& seqContainer):
-		_seqContainer(seqContainer), 
-		_flatCounter(nullptr), _numKmers(0)
+		_seqContainer(seqContainer), _outputProgress(false),
+		_memoryBudget(0), _useFlatCounter(false), _flatCounter(nullptr), 
+		_saturatedShift(0), _storeSingletons(true), _numSingletons(0),
+		_numKmers(0)
 	{}
 
 	~KmerCounter()
 	{
-		if (_flatCounter) 
-		{
-			delete[] _flatCounter;
-			_flatCounter = nullptr;
-		}
+		this->clear();
 	}
 
 	const KmerDistribution& getKmerHist() const
@@ -44,20 +47,84 @@ public:
 		return _kmerDistribution;
 	}
 
-	void   count(bool useFlatCounter);
+	//The counting strategy is selected based on the k-mer size
+	//and the memory budget: flat array (k <= 17), partitioned 
+	//counting in memory, or partitioned counting through 
+	//temporary files in tempDir
+	void   count();
+	//with the singleton filter (partitioned counting only), 
+	//k-mers that occur once are not stored and have zero frequency.
+	//They are still included into the k-mer histogram
 	size_t getFreq(Kmer kmer) const;
 	size_t getKmerNum() const;
 	void clear();
 	void setOutputProgress(bool progress) {_outputProgress = progress;}
 
+	//budget in bytes, 0 means no limit
+	void setMemoryBudget(size_t budget, const std::string& tempDir)
+	{
+		_memoryBudget = budget;
+		_tempDir = tempDir;
+	}
+
 private:
+	//Partitioned counting: the k-mers are distributed into partitions
+	//by hash. Partitions are processed in passes (so that the k-mer 
+	//occurrences of one pass fit into a buffer): all occurrences
+	//are collected, then each partition is sorted and counted.
+	//Distinct k-mers are stored sorted, with the counts
+	struct CountedPartition
+	{
+		std::vector<Kmer::KmerRepr> kmers;
+		std::vector<uint32_t> counts;
+	};
+	static const size_t PARTITION_BITS = 10;
+	static const size_t MIN_FILE_BITS = 8;
+	static const size_t MIN_PASS_KMERS = 1ULL << 28;
+	static const size_t MAX_MEMORY_PASSES = 4;
+	static const size_t MAX_FLAT_KMER = 17;
+	static const size_t SATURATED_BUCKET_BITS = 16;
+	static const size_t FILTER_PROBE_FRACTION = 16;
+	static const size_t HIST_BLOCK_BYTES = 1ULL << 18;
+
+	static size_t partitionId(Kmer kmer)
+		{return kmer.hash() >> (64 - PARTITION_BITS);}
+
+	void countFlat();
+	void countSaturated();
+	//false if the passes do not fit into the memory budget
+	bool countPartitioned(size_t maxPassKmers);
+	void countExternal(size_t expectedKmers);
+	void countPartition(Kmer::KmerRepr* begin, Kmer::KmerRepr* end,
+						CountedPartition& partition);
+	size_t saturatedFreq(Kmer kmer) const;
+	size_t buildSingletonFilter(const std::vector<FastaRecord::Id>& reads);
+	void releaseSingletonFilter(size_t totalKmers, size_t passedKmers);
+	bool passesFilter(Kmer kmer) const
+		{return !_singletonFilter || _singletonFilter->isRepeated(kmer);}
+
 	const SequenceContainer& 	_seqContainer;
 	bool _outputProgress;
+	size_t _memoryBudget;
+	std::string _tempDir;
 	bool _useFlatCounter;
 
+	std::vector<CountedPartition>	_partitions;
 	std::atomic<uint8_t>*			_flatCounter;
-	//std::vector<std::atomic<char>>  _flatCounter;
-	cuckoohash_map<Kmer, size_t> 	_hashCounter;
+
+	//k-mers that saturated the 4-bit flat counter, sorted, with 
+	//the total counts. Indexed by the top bits of the k-mer
+	std::vector<Kmer::KmerRepr>		_saturatedKmers;
+	std::unique_ptr<std::atomic<uint32_t>[]> _saturatedCounts;
+	std::vector<size_t>				_saturatedBuckets;
+	size_t							_saturatedShift;
+
+	//filters out most of the k-mers that occur once, before
+	//they get to the partitioned counter
+	std::unique_ptr<RepeatedKmerFilter> _singletonFilter;
+	bool _storeSingletons;
+	std::atomic<size_t> _numSingletons;
+
 	KmerDistribution _kmerDistribution;
 
 	std::atomic<size_t> _numKmers;
@@ -72,7 +139,8 @@ public:
 	}
 	VertexIndex(const SequenceContainer& seqContainer):
 		_seqContainer(seqContainer), _outputProgress(false), 
-		_sampleRate(1.0f), _repetitiveFrequency(0),
+		_sampleRate(1.0f), _repetitiveFrequency(0), _bucketShift(0),
+		_numRepetitive(0),
 		_kmerCounter(seqContainer)
 		//_solidMultiplier(1)
 		//_flankRepeatSize(flankRepeatSize)
@@ -130,7 +198,7 @@ private:
 			capacity(capacity), size(size), data(nullptr) {}
 		uint32_t capacity;
 		uint32_t size;
-		IndexChunk* data;
+		const IndexChunk* data;
 	};
 
 public:
@@ -214,16 +282,60 @@ public:
 	void buildIndex(int minCoverage);
 	void buildIndexUnevenCoverage(int minCoverage, float selectRate, 
 								  int tandemFreq);
+	//indexes the k-mers sampled with the scheme set by "kmer_sampling"
+	//config parameter (minimizers or syncmers) with the given window
 	void buildIndexMinimizers(int minCoverage, int wndLen);
 	void clear();
 
+	//The frozen index could be stored into a binary file, which
+	//is memory-mapped on load. The index is only loaded if it was
+	//built from the same sequences with the same k-mer size and
+	//build parameters, otherwise false is returned
+	void save(const std::string& fileName, const std::string& buildParams);
+	bool load(const std::string& fileName, const std::string& buildParams);
+
+	//if the index cache directory is set, tries to load the index
+	//from there first. Otherwise, builds it with buildFun and saves
+	//into the cache
+	void buildCached(const std::string& indexName, const std::string& buildParams,
+					 const std::function<void()>& buildFun);
+
 	IterHelper iterKmerPos(Kmer kmer) const
 	{
 		bool revComp = kmer.standardForm();
-		return IterHelper(_kmerIndex.find(kmer), revComp,
+		return IterHelper(this->getReadVector(kmer), revComp,
 						  _seqContainer);
 	}
 
+	//same as above, for the k-mers that are already canonical
+	IterHelper iterKmerPos(const CanonicalKmerPosition& kmerPos) const
+	{
+		return IterHelper(this->getReadVector(kmerPos.kmer), kmerPos.revComp,
+						  _seqContainer);
+	}
+
+	//same as above, but also reports if the k-mer is repetitive 
+	//(then, no positions are returned) with the same index lookup
+	IterHelper iterKmerPos(const CanonicalKmerPosition& kmerPos, 
+						   bool& repetitive) const
+	{
+		const size_t kmerId = this->findKmer(kmerPos.kmer);
+		repetitive = kmerId != NOT_FOUND && this->isRepetitiveId(kmerId);
+		return IterHelper(this->getReadVector(kmerId), kmerPos.revComp,
+						  _seqContainer);
+	}
+
+	//maximum number of k-mers in a batched query
+	static const size_t QUERY_BATCH = 16;
+
+	//Batched version of the above for up to QUERY_BATCH k-mers. The 
+	//lookups are independent, so every step (bucket, k-mer, offsets,
+	//positions) is prefetched for the whole batch before it is read,
+	//and the memory latencies of the lookups overlap
+	void iterKmerPosBatch(const CanonicalKmerPosition* kmers, size_t numKmers,
+						  std::vector<IterHelper>& outPositions,
+						  bool* outRepetitive) const;
+
 	//__attribute__((always_inline))
 	/*bool isSolid(Kmer kmer) const
 	{
@@ -234,15 +346,25 @@ public:
 	bool isRepetitive(Kmer kmer) const
 	{
 		kmer.standardForm();
-		return _repetitiveKmers.contains(kmer);
+		const size_t kmerId = this->findKmer(kmer);
+		return kmerId != NOT_FOUND && this->isRepetitiveId(kmerId);
+	}
+
+	bool isRepetitive(const CanonicalKmerPosition& kmerPos) const
+	{
+		const size_t kmerId = this->findKmer(kmerPos.kmer);
+		return kmerId != NOT_FOUND && this->isRepetitiveId(kmerId);
 	}
 	
 	size_t kmerFreq(Kmer kmer) const
 	{
 		kmer.standardForm();
-		ReadVector rv;
-		_kmerIndex.find(kmer, rv);
-		return rv.size;
+		return this->getReadVector(kmer).size;
+	}
+
+	size_t kmerFreq(const CanonicalKmerPosition& kmerPos) const
+	{
+		return this->getReadVector(kmerPos.kmer).size;
 	}
 
 	void outputProgress(bool set) 
@@ -251,6 +373,11 @@ public:
 		_kmerCounter.setOutputProgress(set);
 	}
 
+	void setKmerMemoryBudget(size_t budget, const std::string& tempDir)
+	{
+		_kmerCounter.setMemoryBudget(budget, tempDir);
+	}
+
 	const KmerDistribution& getKmerHist() const
 	{
 		return _kmerCounter.getKmerHist();
@@ -265,15 +392,65 @@ private:
 
 	struct KmerFreq
 	{
-		Kmer kmer;
+		Kmer kmer;		//canonical
 		int32_t position;
+		bool revComp;
 		size_t freq;
 	};
 	std::vector<KmerFreq>
 		yieldFrequentKmers(const FastaRecord::Id& seqId,
 						   float selctRate, int tandemFreq);
 
+	//k-mer occurrence, selected in the first indexing pass
+	struct SelectedKmer
+	{
+		Kmer::KmerRepr kmer;
+		uint32_t position;	//the highest bit is set for reverse complement
+		uint32_t freq;
+	};
+	static const uint32_t REV_COMP_BIT = 1U << 31;
+
+	static const size_t NOT_FOUND = (size_t)-1;
+
+	//lock-free lookup of a canonical k-mer in the sorted index
+	size_t findKmer(Kmer kmer) const
+	{
+		if (_view.numKmers == 0) return NOT_FOUND;
+		const size_t bucket = kmer.numRepr() >> _view.bucketShift;
+		auto begin = _view.kmers + _view.buckets[bucket];
+		auto end = _view.kmers + _view.buckets[bucket + 1];
+		auto it = std::lower_bound(begin, end, kmer.numRepr());
+		if (it == end || *it != kmer.numRepr()) return NOT_FOUND;
+		return it - _view.kmers;
+	}
+
+	bool isRepetitiveId(size_t kmerId) const
+	{
+		return (_view.repetitive[kmerId / 64] >> (kmerId % 64)) & 1;
+	}
+
+	ReadVector getReadVector(Kmer kmer) const
+	{
+		return this->getReadVector(this->findKmer(kmer));
+	}
+
+	ReadVector getReadVector(size_t kmerId) const
+	{
+		if (kmerId == NOT_FOUND) return ReadVector();
+		const uint32_t size = _view.offsets[kmerId + 1] - _view.offsets[kmerId];
+		ReadVector rv(size, size);
+		rv.data = _view.positions + _view.offsets[kmerId];
+		return rv;
+	}
+
+	void updateIndexView();
+	uint64_t sequencesHash() const;
+
+	void addIndexPosition(const FastaRecord::Id& readId, Kmer kmer,
+						  int32_t position, bool revComp);
 	void allocateIndexMemory();
+	void buildKmerBuckets();
+	void finalizeIndex();
 	void filterFrequentKmers(int minCoverage, float rate);
 
 	const SequenceContainer& _seqContainer;
@@ -283,12 +460,44 @@ private:
 	size_t  _repetitiveFrequency;
 	//int32_t _solidMultiplier;
 
-	const size_t MEM_CHUNK = 32 * 1024 * 1024 / sizeof(IndexChunk);
-	std::vector<IndexChunk*> _memoryChunks;
-
+	//k-mer capacities, only used while the index is being built
 	cuckoohash_map<Kmer, ReadVector> _kmerIndex;
+
+	//frozen index: sorted k-mers with the bucket directory over their 
+	//top bits, and the offsets into the packed positions array (CSR).
+	//Repetitive k-mers are also stored (without positions) and marked
+	//in the bit vector, so a single lookup answers both queries
+	std::vector<Kmer::KmerRepr> _indexKmers;
+	std::vector<size_t>			_indexOffsets;
+	std::vector<size_t>			_kmerBuckets;
+	size_t						_bucketShift;
+	std::vector<IndexChunk>		_indexPositions;
+	std::vector<uint64_t>		_repetitiveFlags;
+	size_t						_numRepetitive;
+	//next free slot of each k-mer during the index fill. Every slot
+	//is written by exactly one thread, and the fields of the adjacent 
+	//packed chunks are separate memory locations, so no padding
+	//between the position arrays is needed
+	std::unique_ptr<std::atomic<uint32_t>[]> _fillCursors;
+
+	//frozen index arrays that are used for queries: either the 
+	//vectors above, or a memory-mapped index file
+	struct IndexView
+	{
+		IndexView(): kmers(nullptr), offsets(nullptr), buckets(nullptr),
+			positions(nullptr), repetitive(nullptr), numKmers(0), 
+			bucketShift(0) {}
+		const Kmer::KmerRepr* kmers;
+		const size_t* 		  offsets;
+		const size_t* 		  buckets;
+		const IndexChunk* 	  positions;
+		const uint64_t*		  repetitive;
+		size_t numKmers;
+		size_t bucketShift;
+	};
+	IndexView _view;
+	std::shared_ptr<const void> _mappedIndex;
 	//cuckoohash_map<Kmer, size_t> 	 _kmerCounts;
-	cuckoohash_map<Kmer, char> 	 	 _repetitiveKmers;
 
 	KmerCounter _kmerCounter;
 };
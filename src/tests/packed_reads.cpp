@@ -0,0 +1,154 @@
+//(c) 2020 by Authors
+//This file is a part of Flye program.
+//Released under the BSD license (see LICENSE file)
+
+//Loading of packed read files: a valid file is read back unchanged,
+//and truncated or corrupted files (section offsets outside of the
+//file, sizes that overflow when multiplied or added) are rejected
+//with ParseException instead of being read out of bounds.
+//Run by "make packed-test".
+//Usage: packed_reads [temporary directory]
+
+#include <random>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+
+#include "../sequence/sequence_container.h"
+
+namespace
+{
+	//byte offsets of the fields, as laid out by writePacked
+	const size_t NUM_SEQUENCES = 16;
+	const size_t TABLE_OFFSET = 24;
+	const size_t NAMES_OFFSET = 32;
+	const size_t CHUNKS_OFFSET = 40;
+	const size_t HEADER_SIZE = 56;
+	const size_t ENTRY_SIZE = 32;
+	const size_t ENTRY_CHUNK_OFFSET = 0;
+	const size_t ENTRY_NAME_OFFSET = 16;
+
+	std::vector<char> readBytes(const std::string& fileName)
+	{
+		std::vector<char> bytes;
+		FILE* fin = fopen(fileName.c_str(), "rb");
+		if (!fin) return bytes;
+		char buffer[4096];
+		size_t bytesRead = 0;
+		while ((bytesRead = fread(buffer, 1, sizeof(buffer), fin)) > 0)
+		{
+			bytes.insert(bytes.end(), buffer, buffer + bytesRead);
+		}
+		fclose(fin);
+		return bytes;
+	}
+
+	void writeBytes(const std::string& fileName, const std::vector<char>& bytes)
+	{
+		FILE* fout = fopen(fileName.c_str(), "wb");
+		if (!fout) return;
+		fwrite(bytes.data(), 1, bytes.size(), fout);
+		fclose(fout);
+	}
+
+	uint64_t getField(const std::vector<char>& bytes, size_t offset)
+	{
+		uint64_t value = 0;
+		memcpy(&value, bytes.data() + offset, sizeof(value));
+		return value;
+	}
+
+	void setField(std::vector<char>& bytes, size_t offset, uint64_t value)
+	{
+		memcpy(bytes.data() + offset, &value, sizeof(value));
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const std::string tempDir = argc > 1 ? argv[1] : ".";
+	const std::string validFile = tempDir + "/packed_reads_valid.bin";
+	const std::string brokenFile = tempDir + "/packed_reads_broken.bin";
+
+	std::mt19937 randGen(1);
+	std::vector<std::string> texts;
+	SequenceContainer original;
+	for (size_t i = 0; i < 10; ++i)
+	{
+		std::string text(50 + randGen() % 200, 'A');
+		for (auto& c : text) c = "ACGT"[randGen() % 4];
+		texts.push_back(text);
+		original.addSequence(DnaSequence(text), "read_" + std::to_string(i));
+	}
+	original.writePacked(validFile);
+
+	size_t numErrors = 0;
+	{
+		SequenceContainer loaded;
+		loaded.loadFromFile(validFile);
+		size_t seqId = 0;
+		for (const auto& seq : loaded.iterSeqs())
+		{
+			if (!seq.id.strand()) continue;
+			if (seqId >= texts.size() || seq.sequence.str() != texts[seqId] ||
+				loaded.seqName(seq.id) != "+read_" + std::to_string(seqId))
+			{
+				++numErrors;
+			}
+			++seqId;
+		}
+		if (seqId != texts.size()) ++numErrors;
+		printf("valid file: %s\n", numErrors ? "FAILED" : "OK");
+	}
+
+	const std::vector<char> valid = readBytes(validFile);
+	const uint64_t tableOffset = getField(valid, TABLE_OFFSET);
+	std::vector<std::pair<std::string,
+				std::function<void(std::vector<char>&)>>> corruptions =
+	{
+		{"truncated chunks", [](std::vector<char>& bytes)
+			{bytes.resize(bytes.size() - 8);}},
+		{"truncated header", [](std::vector<char>& bytes)
+			{bytes.resize(HEADER_SIZE / 2);}},
+		{"chunks past the end", [](std::vector<char>& bytes)
+			{setField(bytes, CHUNKS_OFFSET, bytes.size() + 64);}},
+		{"names past chunks", [](std::vector<char>& bytes)
+			{setField(bytes, NAMES_OFFSET, getField(bytes, CHUNKS_OFFSET) + 8);}},
+		{"table inside the header", [](std::vector<char>& bytes)
+			{setField(bytes, TABLE_OFFSET, 0);}},
+		{"overflowing table size", [](std::vector<char>& bytes)
+			{setField(bytes, NUM_SEQUENCES,
+					  getField(bytes, NUM_SEQUENCES) + (1ULL << 59));}},
+		{"overflowing chunk offset", [tableOffset](std::vector<char>& bytes)
+			{setField(bytes, tableOffset + ENTRY_CHUNK_OFFSET, UINT64_MAX - 1);}},
+		{"overflowing name offset", [tableOffset](std::vector<char>& bytes)
+			{setField(bytes, tableOffset + ENTRY_SIZE + ENTRY_NAME_OFFSET,
+					  UINT64_MAX - 1);}}
+	};
+
+	for (const auto& corruption : corruptions)
+	{
+		std::vector<char> bytes = valid;
+		corruption.second(bytes);
+		writeBytes(brokenFile, bytes);
+
+		bool rejected = false;
+		try
+		{
+			SequenceContainer loaded;
+			loaded.loadFromFile(brokenFile);
+		}
+		catch (SequenceContainer::ParseException&)
+		{
+			rejected = true;
+		}
+		if (!rejected) ++numErrors;
+		printf("%s: %s\n", corruption.first.c_str(), rejected ? "OK" : "FAILED");
+	}
+
+	std::remove(validFile.c_str());
+	std::remove(brokenFile.c_str());
+	return numErrors ? 1 : 0;
+}
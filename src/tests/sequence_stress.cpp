@@ -0,0 +1,89 @@
+//(c) 2020 by Authors
+//This file is a part of Flye program.
+//Released under the BSD license (see LICENSE file)
+
+//Stress test for the shared DnaSequence buffers: views of the same
+//sequences are copied, assigned, moved and destroyed concurrently
+//from many threads. Built with ThreadSanitizer by "make tsan-test",
+//which reports any data race on the reference counter.
+//Usage: sequence_stress [threads] [iterations]
+
+#include <thread>
+#include <random>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+
+#include "../sequence/sequence.h"
+
+int main(int argc, char** argv)
+{
+	const size_t numThreads = argc > 1 ? atol(argv[1]) : 8;
+	const size_t numIters = argc > 2 ? atol(argv[2]) : 100000;
+
+	std::mt19937 randGen(1);
+	std::vector<DnaSequence> shared;
+	std::vector<std::string> texts;
+	for (size_t i = 0; i < 4; ++i)
+	{
+		std::string text(1000 + i * 100, 'A');
+		for (auto& c : text) c = "ACGT"[randGen() % 4];
+		texts.push_back(text);
+		shared.emplace_back(text);
+	}
+
+	std::vector<size_t> errors(numThreads, 0);
+	std::vector<std::thread> threads;
+	for (size_t threadId = 0; threadId < numThreads; ++threadId)
+	{
+		threads.emplace_back([threadId, numIters, &shared, &texts, &errors]()
+		{
+			std::mt19937 threadGen(threadId);
+			std::vector<DnaSequence> local(8);
+			for (size_t iter = 0; iter < numIters; ++iter)
+			{
+				const size_t seqId = threadGen() % shared.size();
+				const size_t slot = threadGen() % local.size();
+				switch (threadGen() % 5)
+				{
+					case 0:		//copy assignment
+						local[slot] = shared[seqId];
+						break;
+					case 1:		//copy construction, then move
+					{
+						DnaSequence copy(shared[seqId]);
+						local[slot] = std::move(copy);
+						break;
+					}
+					case 2:		//substring view
+					{
+						const size_t start = threadGen() % 500;
+						local[slot] = shared[seqId].substr(start, 100);
+						if (local[slot].str() != texts[seqId].substr(start, 100))
+						{
+							++errors[threadId];
+						}
+						break;
+					}
+					case 3:		//view of a view, on the other strand
+						local[slot] = local[(slot + 1) % local.size()].complement();
+						break;
+					case 4:		//destroy
+						local[slot] = DnaSequence();
+						break;
+				}
+			}
+		});
+	}
+	for (auto& thread : threads) thread.join();
+
+	size_t totalErrors = 0;
+	for (size_t err : errors) totalErrors += err;
+	for (size_t i = 0; i < shared.size(); ++i)
+	{
+		if (shared[i].str() != texts[i]) ++totalErrors;
+	}
+	printf("%zu threads x %zu iterations: %s\n", numThreads, numIters,
+		   totalErrors ? "FAILED" : "OK");
+	return totalErrors ? 1 : 0;
+}